@@ -4,15 +4,31 @@
 #include <errno.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <fcntl.h>
 #include <openssl/md5.h>
 #include <zlib.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "trace.h"
+#define TRACE_MESSAGE(dir, msg) traceMessage(dir, msg)
 #include "message.h"
+#include "pdeflate.h"
+#include "mbmd5.h"
+
+#include <time.h>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#endif
 
 #ifdef WIN32
 typedef int socklen_t;
 #define SHUT_RDWR SD_BOTH
 void PrintSocketError(const char *name);
 ssize_t getline(char **lineptr, size_t *n, FILE *stream);
+#define lstat stat
 #else
 #include <netdb.h>
 #include <sys/socket.h>
@@ -20,36 +36,188 @@ ssize_t getline(char **lineptr, size_t *n, FILE *stream);
 #define PrintSocketError perror
 #endif
 
+// files at least this big are compressed on every core
+#define PARALLEL_THRESHOLD (1024*1024)
+
+// files at least this big are compared chunk by chunk
+#define CHUNK_THRESHOLD (4*CHUNKSUM_SIZE)
+
+// the deflaters couldn't read the whole file, but did end the stream
+#define READ_FAILED 2
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 static unsigned char buf[1024];
 static const int on = 1;
 
-static int update(int s, const char *filename);
-static int md5sum(unsigned char *digest, const char *filename);
+// set up on the first update and reset for every file after that
+static z_stream deflater;
+static int      deflating = 0;
+
+static int dryRun    = 0;
+static int pruneMode = 0;
+static int watchMode = 0;
+
+// files left out because they went away or changed while being read
+static unsigned long skipped = 0;
+
+// what a dry run would have done
+static struct {
+  unsigned long dirs;
+  unsigned long files;
+  unsigned long long bytes;
+  unsigned long deletes;
+} summary;
+
+// codec profile agreed on with the daemon
+static profile_t profile = {
+  .windowBits = MAX_WBITS,
+  .memLevel   = 8,
+  .frameSize  = sizeof(((message_t*)NULL)->data),
+};
+
+typedef struct node {
+  char          *name;
+  int           isdir;
+  unsigned char digest[16]; // md5sum for files, DIRHASH for directories
+  struct node   *children;
+  size_t        numChildren;
+} node_t;
+
+// one entry of a directory LIST from the daemon
+typedef struct {
+  char          name[256];
+  int           isdir;
+  uint32_t      size;
+  uint32_t      mtime;
+  unsigned char digest[16];
+} entry_t;
+
+// files found while scanning, hashed together once the whole tree is known
+typedef struct {
+  char          **paths;
+  unsigned char **digests;
+  size_t        num;
+  size_t        alloc;
+} batch_t;
+
+static int  hello(int s);
+static int  syncTree(int s);
+static int  scanTree(node_t *node, const char *path);
+static int  readTree(node_t *node, const char *path, batch_t *batch);
+static void hashTree(node_t *node);
+static void freeTree(node_t *node);
+static int  compareDir(int s, const node_t *node, const char *path);
+static int  syncDir(int s, const node_t *node, const char *path);
+static int  listDir(int s, const char *path, entry_t **entries, size_t *numEntries);
+static int  removeTree(int s, const entry_t *entry, const char *path);
+static int  sendDelete(int s, const char *path);
+static int  syncFile(int s, const node_t *node, const char *path);
+static int  pushTree(int s, const node_t *node, const char *path);
+static int  setPath(message_t *msg, message_type_t type, const char *path);
+static void joinPath(char *out, const char *dir, const char *name);
+static int  sendMkdir(int s, const char *dirname);
+static int  compareChunks(int s, const char *path, uint32_t *offset);
+static int  updateChanged(int s, const char *filename);
+static int  update(int s, const char *filename, uint32_t offset);
+static void skipFile(const char *path, int retry);
+static int  deflateSerial(int s, int fd, uLong *totalIn, uLong *totalOut);
+#ifndef WIN32
+static int  deflateParallel(int s, int fd, uint32_t offset, int threads,
+                            uLong *totalIn, uLong *totalOut);
+#endif
+#ifdef __linux__
+static int  watch(int s);
+static int  queueChange(const char *path, int isdir);
+#endif
+
+static void usage(const char *argv0) {
+  fprintf(stderr, "Usage: %s [--watch] [--dry-run] [--prune]"
+                  " [--record|--record-headers <trace>] <directory> [host]\n"
+                  "       %s --replay <trace> [--speed <factor>] [host]\n"
+                  "       %s --dump <trace>\n",
+          argv0, argv0, argv0);
+}
 
 int main(int argc, char *argv[]) {
-  FILE   *find;
-  char   *line = NULL;
-  size_t linesz = 0;
-  int    rc;
+  int    rc, i;
   int    s, b;
-  char   *cmd;
-  const char *host = NULL, *directory;
-  message_t msg;
-  unsigned char digest[16];
+  int    recordPayload = 0;
+  double speed = 1;
+  const char *host = NULL, *directory = NULL;
+  const char *recordPath = NULL, *replayPath = NULL, *dumpPath = NULL;
   struct addrinfo hints, *res;
   struct sockaddr_in addr;
   socklen_t          addr_len = sizeof(addr);
 
-  if(argc != 2 && argc != 3) {
-    fprintf(stderr, "Usage: %s <directory> [host]\n", argv[0]);
+  for(i = 1; i < argc && strncmp(argv[i], "--", 2) == 0; i++) {
+    if(strcmp(argv[i], "--watch") == 0)
+      watchMode = 1;
+    else if(strcmp(argv[i], "--dry-run") == 0)
+      dryRun = 1;
+    else if(strcmp(argv[i], "--prune") == 0)
+      pruneMode = 1;
+    else if(strcmp(argv[i], "--record") == 0 && i+1 < argc) {
+      recordPath    = argv[++i];
+      recordPayload = 1;
+    }
+    else if(strcmp(argv[i], "--record-headers") == 0 && i+1 < argc)
+      recordPath = argv[++i];
+    else if(strcmp(argv[i], "--replay") == 0 && i+1 < argc)
+      replayPath = argv[++i];
+    else if(strcmp(argv[i], "--speed") == 0 && i+1 < argc)
+      speed = strtod(argv[++i], NULL);
+    else if(strcmp(argv[i], "--dump") == 0 && i+1 < argc)
+      dumpPath = argv[++i];
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if(dumpPath != NULL) {
+    if(argc != i) {
+      usage(argv[0]);
+      return 1;
+    }
+    return traceDump(dumpPath) == 0 ? 0 : 1;
+  }
+
+  if(replayPath != NULL) {
+    if(argc - i > 1 || watchMode || dryRun || pruneMode || recordPath) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  else if((argc - i != 1 && argc - i != 2) || (watchMode && dryRun)) {
+    usage(argv[0]);
     return 1;
   }
 
-  directory = argv[1];
-  if(argc == 3)
-    host = argv[2];
+#ifndef __linux__
+  if(watchMode) {
+    fprintf(stderr, "--watch is only supported on Linux\n");
+    return 1;
+  }
+#endif
+
+  if(replayPath != NULL) {
+    if(argc - i == 1)
+      host = argv[i];
+  }
+  else {
+    directory = argv[i];
+    if(argc - i == 2)
+      host = argv[i+1];
+  }
 
-  if(chdir(directory)) {
+  // before chdir(), so a relative path isn't inside the directory
+  if(recordPath != NULL && traceOpen(recordPath, recordPayload) == -1)
+    return 1;
+
+  if(directory != NULL && chdir(directory)) {
     fprintf(stderr, "chdir('%s'):  %s\n", directory, strerror(errno));
     return 1;
   }
@@ -128,226 +296,1268 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  cmd = "find * -type d | sort";
-  find = popen(cmd, "r");
-  if(find == NULL) {
-    fprintf(stderr, "popen('%s'): %s\n", cmd, strerror(errno));
+  if(replayPath != NULL) {
+    rc = traceReplay(s, replayPath, speed);
     shutdown(s, SHUT_RDWR);
     closesocket(s);
-    return 1;
+    return rc == 0 ? 0 : 1;
   }
 
-  while((rc = getline(&line, &linesz, find)) != -1) {
-    if(line[rc-1] == '\n')
-      line[rc-1] = 0;
-    memset(&msg, 0, sizeof(msg));
-    msg.header.size = rc+1;
-    msg.header.type = MKDIR;
-    msg.data[0] = '/';
-    memcpy(msg.data+1, line, rc);
-    printf("mkdir %s\n", msg.data);
+  rc = hello(s);
+  if(rc == 0)
+    rc = syncTree(s);
+  if(rc == 0 && skipped > 0 && !watchMode) {
+    fprintf(stderr, "%lu files skipped; run the sync again\n", skipped);
+    rc = -1;
+  }
+  if(rc == 0 && dryRun) {
+    printf("Dry run: %lu directories to create, %lu files (%llu bytes) to send,"
+           " %lu entries to prune\n",
+           summary.dirs, summary.files, summary.bytes, summary.deletes);
+  }
+#ifdef __linux__
+  if(rc == 0 && watchMode)
+    rc = watch(s);
+#endif
 
-    rc = sendMessage(s, &msg);
-    if(rc <= 0) {
-      shutdown(s, SHUT_RDWR);
-      closesocket(s);
-      pclose(find);
-      free(line);
-      return 1;
+  if(deflating)
+    deflateEnd(&deflater);
+  traceClose();
+  shutdown(s, SHUT_RDWR);
+  closesocket(s);
+
+  return rc == 0 ? 0 : 1;
+}
+
+static int hello(int s) {
+  message_t msg;
+  uint32_t  memory;
+  int       rc;
+
+  memset(&msg, 0, sizeof(msg));
+  msg.header.type = HELLO;
+  msg.header.size = 0;
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return -1;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0 || msg.header.rc == -1)
+    return -1;
+  if(msg.header.size != sizeof(msg.profile)) {
+    fprintf(stderr, "hello: Invalid reply from daemon\n");
+    return -1;
+  }
+
+  // use the biggest window the daemon can afford to inflate
+  memory = ntohl(msg.profile.memory);
+  profile.windowBits = msg.profile.windowBits;
+  if(profile.windowBits > MAX_WBITS)
+    profile.windowBits = MAX_WBITS;
+  while(profile.windowBits > MIN_WINDOW_BITS
+  && INFLATE_MEMORY(profile.windowBits) > memory)
+    profile.windowBits--;
+  if(INFLATE_MEMORY(profile.windowBits) > memory) {
+    fprintf(stderr, "hello: Daemon has only %u bytes for decompression\n",
+            (unsigned int)memory);
+    return -1;
+  }
+
+  // memLevel only costs memory on our side, so spend it
+  profile.memLevel = MAX_MEM_LEVEL;
+
+  profile.frameSize = ntohs(msg.profile.frameSize);
+  if(profile.frameSize == 0 || profile.frameSize > sizeof(msg.data))
+    profile.frameSize = sizeof(msg.data);
+
+  printf("Daemon codec budget: %u bytes\n", (unsigned int)memory);
+  printf("Using windowBits=%d memLevel=%d frameSize=%d\n",
+         profile.windowBits, profile.memLevel, profile.frameSize);
+
+  msg.header.type        = HELLO;
+  msg.header.rc          = 0;
+  msg.header.size        = sizeof(msg.profile);
+  msg.profile.memory     = htonl(memory);
+  msg.profile.windowBits = profile.windowBits;
+  msg.profile.memLevel   = profile.memLevel;
+  msg.profile.frameSize  = htons(profile.frameSize);
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return -1;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0 || msg.header.rc == -1) {
+    fprintf(stderr, "hello: Daemon rejected the codec profile\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int syncTree(int s) {
+  node_t root;
+  size_t i;
+  int    rc = 0;
+
+  if(scanTree(&root, "") == -1) {
+    freeTree(&root);
+    return -1;
+  }
+
+  // the root of the card holds more than what we sync, so it is never
+  // compared as a whole; start with each top-level entry instead
+  for(i = 0; i < root.numChildren && rc == 0; i++) {
+    if(root.children[i].isdir)
+      rc = compareDir(s, &root.children[i], root.children[i].name);
+    else
+      rc = syncFile(s, &root.children[i], root.children[i].name);
+  }
+
+  freeTree(&root);
+  return rc;
+}
+
+static int compareNodes(const void *a, const void *b) {
+  return strcmp(((const node_t*)a)->name, ((const node_t*)b)->name);
+}
+
+static int scanTree(node_t *node, const char *path) {
+  batch_t batch;
+  size_t  i, failed;
+  int     rc;
+
+  memset(&batch, 0, sizeof(batch));
+
+  rc = readTree(node, path, &batch);
+  while(rc == 0 && batch.num > 0
+  && mbmd5((const char *const*)batch.paths, batch.digests, batch.num, &failed) == -1) {
+    fprintf(stderr, "md5sum('%s'): %s\n", batch.paths[failed], strerror(errno));
+
+    /* It went away or changed under us. Its digest stays zeroed, so it is
+     * sent and update() skips it if it's still unreadable. Any lane may have
+     * been cut short, so hash the rest again without it.
+     */
+    memset(batch.digests[failed], 0, sizeof(node->digest));
+    free(batch.paths[failed]);
+    batch.num--;
+    memmove(batch.paths+failed, batch.paths+failed+1,
+            (batch.num-failed)*sizeof(*batch.paths));
+    memmove(batch.digests+failed, batch.digests+failed+1,
+            (batch.num-failed)*sizeof(*batch.digests));
+  }
+  if(rc == 0)
+    hashTree(node);
+
+  for(i = 0; i < batch.num; i++)
+    free(batch.paths[i]);
+  free(batch.paths);
+  free(batch.digests);
+
+  return rc;
+}
+
+static int readTree(node_t *node, const char *path, batch_t *batch) {
+  DIR           *dp;
+  struct dirent *ent;
+  struct stat   st;
+  char          child[PATH_MAX];
+  node_t        *p;
+  size_t        i;
+  void          *q;
+
+  node->children    = NULL;
+  node->numChildren = 0;
+
+  dp = opendir(path[0] ? path : ".");
+  if(dp == NULL) {
+    fprintf(stderr, "opendir('%s'): %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  while((ent = readdir(dp)) != NULL) {
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    // match 'find *', which skips hidden entries at the top level
+    if(path[0] == 0 && ent->d_name[0] == '.')
+      continue;
+
+    joinPath(child, path, ent->d_name);
+    if(lstat(child, &st) == -1 || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+      continue;
+
+    p = realloc(node->children, (node->numChildren+1)*sizeof(*p));
+    if(p == NULL) {
+      closedir(dp);
+      return -1;
     }
+    node->children = p;
+    p = &node->children[node->numChildren++];
+    memset(p, 0, sizeof(*p));
+    p->name  = strdup(ent->d_name);
+    p->isdir = S_ISDIR(st.st_mode);
+  }
+  closedir(dp);
 
+  qsort(node->children, node->numChildren, sizeof(*node->children), compareNodes);
+
+  for(i = 0; i < node->numChildren; i++) {
+    p = &node->children[i];
+    joinPath(child, path, p->name);
+    if(p->isdir) {
+      if(readTree(p, child, batch) == -1)
+        return -1;
+      continue;
+    }
+
+    if(batch->num == batch->alloc) {
+      batch->alloc = batch->alloc ? batch->alloc*2 : 64;
+      q = realloc(batch->paths, batch->alloc*sizeof(*batch->paths));
+      if(q == NULL)
+        return -1;
+      batch->paths = q;
+      q = realloc(batch->digests, batch->alloc*sizeof(*batch->digests));
+      if(q == NULL)
+        return -1;
+      batch->digests = q;
+    }
+    batch->paths[batch->num] = strdup(child);
+    if(batch->paths[batch->num] == NULL)
+      return -1;
+    batch->digests[batch->num++] = p->digest;
+  }
+
+  return 0;
+}
+
+static void hashTree(node_t *node) {
+  unsigned char type;
+  node_t        *p;
+  size_t        i;
+  MD5_CTX       ctx;
+
+  MD5_Init(&ctx);
+  for(i = 0; i < node->numChildren; i++) {
+    p = &node->children[i];
+    if(p->isdir)
+      hashTree(p);
+
+    type = p->isdir ? DIRHASH_DIR : DIRHASH_FILE;
+    MD5_Update(&ctx, p->name, strlen(p->name)+1);
+    MD5_Update(&ctx, &type, 1);
+    MD5_Update(&ctx, p->digest, sizeof(p->digest));
+  }
+  MD5_Final(node->digest, &ctx);
+}
+
+
+static void freeTree(node_t *node) {
+  size_t i;
+
+  for(i = 0; i < node->numChildren; i++) {
+    freeTree(&node->children[i]);
+    free(node->children[i].name);
+  }
+  free(node->children);
+  node->children    = NULL;
+  node->numChildren = 0;
+}
+
+static int compareDir(int s, const node_t *node, const char *path) {
+  message_t msg;
+  int       rc;
+
+  if(setPath(&msg, DIRHASH, path) == -1)
+    return -1;
+  printf("dirhash %s\n", msg.data);
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return -1;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0 || msg.header.rc == -1)
+    return -1;
+
+  // nothing below here has changed
+  if(msg.header.size == sizeof(node->digest)
+  && memcmp(msg.hash, node->digest, sizeof(node->digest)) == 0)
+    return 0;
+
+  // the daemon doesn't have it at all
+  if(msg.header.size == 0)
+    return pushTree(s, node, path);
+
+  // there's a file in the way, as syncDir() handles below the top level
+  if(msg.header.size == 1 && msg.data[0] == DIRHASH_FILE) {
+    if(!pruneMode) {
+      fprintf(stderr, "/%s: file on the device; use --prune to replace it\n",
+              path);
+      return 0;
+    }
+    if(sendDelete(s, path) <= 0)
+      return -1;
+    return pushTree(s, node, path);
+  }
+
+  return syncDir(s, node, path);
+}
+
+static const char* formatTime(uint32_t mtime) {
+  static char str[32];
+  time_t      t = mtime;
+
+  strftime(str, sizeof(str), "%Y-%m-%d %H:%M", localtime(&t));
+  return str;
+}
+
+static int syncDir(int s, const node_t *node, const char *path) {
+  char          child[PATH_MAX];
+  const node_t  *local;
+  const entry_t *remote;
+  entry_t       *entries;
+  size_t        numEntries, i = 0, j = 0;
+  int           cmp, rc = 0;
+
+  if(listDir(s, path, &entries, &numEntries) == -1)
+    return -1;
+
+  // both sides are sorted with strcmp(), so walk them together
+  while(rc == 0 && (i < node->numChildren || j < numEntries)) {
+    local  = i < node->numChildren ? &node->children[i] : NULL;
+    remote = j < numEntries ? &entries[j] : NULL;
+    if(local == NULL)
+      cmp = 1;
+    else if(remote == NULL)
+      cmp = -1;
+    else
+      cmp = strcmp(local->name, remote->name);
+
+    // only on the daemon
+    if(cmp > 0) {
+      joinPath(child, path, remote->name);
+      if(pruneMode)
+        rc = removeTree(s, remote, child);
+      j++;
+      continue;
+    }
+
+    joinPath(child, path, local->name);
+    i++;
+    if(cmp == 0)
+      j++;
+    else
+      remote = NULL;
+
+    // a file became a directory or the other way around
+    if(remote != NULL && remote->isdir != local->isdir) {
+      if(!pruneMode) {
+        fprintf(stderr, "/%s: %s on the device; use --prune to replace it\n",
+                child, remote->isdir ? "directory" : "file");
+        continue;
+      }
+      rc = removeTree(s, remote, child);
+      remote = NULL;
+      if(rc != 0)
+        break;
+    }
+
+    if(remote != NULL
+    && memcmp(local->digest, remote->digest, sizeof(local->digest)) == 0)
+      continue;
+
+    if(local->isdir)
+      rc = remote == NULL ? pushTree(s, local, child) : syncDir(s, local, child);
+    else {
+      if(remote != NULL)
+        fprintf(stderr, "update /%s (device: %lu bytes, %s)\n", child,
+                (unsigned long)remote->size, formatTime(remote->mtime));
+      else
+        fprintf(stderr, "update /%s\n", child);
+      if(remote != NULL)
+        rc = updateChanged(s, child) <= 0 ? -1 : 0;
+      else
+        rc = update(s, child, 0) <= 0 ? -1 : 0;
+    }
+  }
+
+  free(entries);
+  return rc;
+}
+
+static int listDir(int s, const char *path, entry_t **entries, size_t *numEntries) {
+  message_t msg;
+  entry_t   *entry;
+  size_t    pos, nameLen, alloc = 0;
+  int       rc;
+  void      *p;
+
+  *entries    = NULL;
+  *numEntries = 0;
+
+  if(setPath(&msg, LIST, path) == -1)
+    return -1;
+  printf("list %s\n", msg.data);
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return -1;
+
+  while(1) {
     rc = recvMessage(s, &msg);
     if(rc <= 0 || msg.header.rc == -1) {
-      shutdown(s, SHUT_RDWR);
-      closesocket(s);
-      pclose(find);
-      free(line);
-      return 1;
+      free(*entries);
+      *entries = NULL;
+      return -1;
+    }
+
+    // an empty frame ends the listing
+    if(msg.header.size == 0)
+      return 0;
+
+    for(pos = 0; pos + LIST_ENTRY_SIZE <= msg.header.size; pos += LIST_ENTRY_SIZE + nameLen) {
+      nameLen = msg.data[pos+1];
+      if(pos + LIST_ENTRY_SIZE + nameLen > msg.header.size)
+        break;
+
+      if(*numEntries == alloc) {
+        alloc = alloc ? alloc*2 : 64;
+        p = realloc(*entries, alloc*sizeof(**entries));
+        if(p == NULL) {
+          free(*entries);
+          *entries = NULL;
+          return -1;
+        }
+        *entries = p;
+      }
+
+      entry = &(*entries)[(*numEntries)++];
+      entry->isdir = msg.data[pos] == DIRHASH_DIR;
+      entry->size  = ((uint32_t)msg.data[pos+2] << 24) | (msg.data[pos+3] << 16)
+                   | (msg.data[pos+4] << 8) | msg.data[pos+5];
+      entry->mtime = ((uint32_t)msg.data[pos+6] << 24) | (msg.data[pos+7] << 16)
+                   | (msg.data[pos+8] << 8) | msg.data[pos+9];
+      memcpy(entry->digest, msg.data+pos+10, sizeof(entry->digest));
+      memcpy(entry->name, msg.data+pos+LIST_ENTRY_SIZE, nameLen);
+      entry->name[nameLen] = 0;
+    }
+
+    if(pos != msg.header.size) {
+      fprintf(stderr, "list %s: Malformed reply from daemon\n", path);
+      free(*entries);
+      *entries = NULL;
+      return -1;
     }
   }
-  pclose(find);
+}
 
-  cmd = "find * -type f | sort";
-  find = popen(cmd, "r");
-  if(find == NULL) {
-    fprintf(stderr, "popen('%s'): %s\n", cmd, strerror(errno));
-    shutdown(s, SHUT_RDWR);
-    closesocket(s);
-    free(line);
+static int removeTree(int s, const entry_t *entry, const char *path) {
+  char    child[PATH_MAX];
+  entry_t *entries;
+  size_t  numEntries, i;
+  int     rc = 0;
+
+  // directories have to be emptied before they can go
+  if(entry->isdir) {
+    if(listDir(s, path, &entries, &numEntries) == -1)
+      return -1;
+    for(i = 0; i < numEntries && rc == 0; i++) {
+      joinPath(child, path, entries[i].name);
+      rc = removeTree(s, &entries[i], child);
+    }
+    free(entries);
+    if(rc != 0)
+      return rc;
+  }
+
+  return sendDelete(s, path) <= 0 ? -1 : 0;
+}
+
+static int syncFile(int s, const node_t *node, const char *path) {
+  message_t   msg;
+  struct stat st;
+  int         rc;
+
+  // don't make the daemon read all of a big file to find it changed early on
+  if(stat(path, &st) == 0 && st.st_size >= CHUNK_THRESHOLD)
+    return updateChanged(s, path) <= 0 ? -1 : 0;
+
+  if(setPath(&msg, MD5SUM, path) == -1)
+    return -1;
+  printf("md5sum %s\n", msg.data);
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return -1;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0 || msg.header.rc == -1)
+    return -1;
+
+  if(msg.header.size == sizeof(node->digest)
+  && memcmp(msg.hash, node->digest, sizeof(node->digest)) == 0)
+    return 0;
+
+  fprintf(stderr, "update /%s\n", path);
+  return update(s, path, 0) <= 0 ? -1 : 0;
+}
+
+static int pushTree(int s, const node_t *node, const char *path) {
+  char   child[PATH_MAX];
+  size_t i;
+  int    rc;
+
+  rc = sendMkdir(s, path);
+  if(rc <= 0)
+    return -1;
+
+  for(i = 0, rc = 0; i < node->numChildren && rc == 0; i++) {
+    joinPath(child, path, node->children[i].name);
+    if(node->children[i].isdir)
+      rc = pushTree(s, &node->children[i], child);
+    else {
+      fprintf(stderr, "update /%s\n", child);
+      rc = update(s, child, 0) <= 0 ? -1 : 0;
+    }
+  }
+
+  return rc;
+}
+
+static int setPath(message_t *msg, message_type_t type, const char *path) {
+  if(strlen(path)+2 > sizeof(msg->data)) {
+    fprintf(stderr, "/%s: path too long\n", path);
+    return -1;
+  }
+
+  msg->header.type = type;
+  msg->header.rc   = 0;
+  msg->header.size = strlen(path)+2;
+  msg->data[0] = '/';
+  memcpy(msg->data+1, path, strlen(path)+1);
+
+  return 0;
+}
+
+static void joinPath(char *out, const char *dir, const char *name) {
+  if(dir[0] == 0)
+    snprintf(out, PATH_MAX, "%s", name);
+  else
+    snprintf(out, PATH_MAX, "%s/%s", dir, name);
+}
+
+static int sendMkdir(int s, const char *dirname) {
+  int rc;
+  message_t msg;
+
+  if(setPath(&msg, MKDIR, dirname) == -1)
+    return -1;
+  printf("mkdir %s\n", msg.data);
+
+  if(dryRun) {
+    summary.dirs++;
     return 1;
   }
 
-  while((rc = getline(&line, &linesz, find)) != -1) {
-    if(line[rc-1] == '\n')
-      line[rc-1] = 0;
-    memset(&msg, 0, sizeof(msg));
-    msg.header.size = rc+1;
-    msg.header.type = MD5SUM;
-    msg.data[0] = '/';
-    memcpy(msg.data+1, line, rc);
-    printf("md5sum %s\n", msg.data);
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return rc;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0)
+    return rc;
+  if(msg.header.rc == -1)
+    return -1;
+
+  return 1;
+}
+
+static int sendDelete(int s, const char *path) {
+  int rc;
+  message_t msg;
 
-    rc = sendMessage(s, &msg);
+  if(setPath(&msg, DELETE, path) == -1)
+    return -1;
+  printf("delete %s\n", msg.data);
+
+  if(dryRun) {
+    summary.deletes++;
+    return 1;
+  }
+
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
+    return rc;
+
+  rc = recvMessage(s, &msg);
+  if(rc <= 0)
+    return rc;
+  if(msg.header.rc == -1)
+    return -1;
+
+  return 1;
+}
+
+/* Compare a big file against the daemon's copy a chunk at a time as the
+ * digests stream in, telling the daemon to stop at the first chunk that
+ * differs. Returns 0 if the files match, or 1 with offset set to how much of
+ * the start of the file the daemon already has.
+ */
+static int compareChunks(int s, const char *path, uint32_t *offset) {
+  message_t     msg;
+  unsigned char digest[16];
+  MD5_CTX       ctx;
+  size_t        len, want;
+  ssize_t       got;
+  int           fd, rc, differs = 0;
+
+  *offset = 0;
+
+  // send it whole; update() skips it if it's really gone
+  fd = open(path, O_RDONLY | O_BINARY);
+  if(fd == -1)
+    return 1;
+
+  if(setPath(&msg, CHUNKSUM, path) == -1) {
+    close(fd);
+    return -1;
+  }
+  printf("chunksum %s\n", msg.data);
+
+  rc = sendMessage(s, &msg);
+  while(rc > 0) {
+    rc = recvMessage(s, &msg);
     if(rc <= 0 || msg.header.rc == -1) {
-      shutdown(s, SHUT_RDWR);
-      closesocket(s);
-      pclose(find);
-      free(line);
-      return 1;
+      rc = -1;
+      break;
     }
 
-    rc = md5sum(digest, line);
-    if(rc == -1) {
-      shutdown(s, SHUT_RDWR);
-      closesocket(s);
-      pclose(find);
-      free(line);
-      return 1;
+    // once we've asked the daemon to stop, skip what it sent meanwhile
+    if(differs && msg.header.size > 0)
+      continue;
+
+    got = 0;
+    len = 0;
+    if(!differs) {
+      MD5_Init(&ctx);
+      while(len < CHUNKSUM_SIZE) {
+        want = CHUNKSUM_SIZE - len;
+        if(want > sizeof(buf))
+          want = sizeof(buf);
+        got = read(fd, buf, want);
+        if(got <= 0)
+          break;
+        MD5_Update(&ctx, buf, got);
+        len += got;
+      }
+      MD5_Final(digest, &ctx);
+      // stop the daemon as for a difference; update() sorts it out
+      if(got == -1) {
+        fprintf(stderr, "read('%s'): %s\n", path, strerror(errno));
+        len = 0;
+      }
     }
 
-    rc = recvMessage(s, &msg);
-    if(rc <= -1 || msg.header.rc == -1) {
-      shutdown(s, SHUT_RDWR);
-      closesocket(s);
-      pclose(find);
-      free(line);
-      return 1;
+    // the daemon's copy ends here; it's a match if ours does too
+    if(msg.header.size == 0) {
+      differs = differs || len > 0 || got == -1;
+      break;
     }
 
-    if(memcmp(digest, msg.data, sizeof(digest))) {
-      fprintf(stderr, "update /%s\n", line);
-      rc = update(s, line);
-      if(rc <= 0) {
-        shutdown(s, SHUT_RDWR);
-        closesocket(s);
-        pclose(find);
-        free(line);
-        return 1;
-      }
+    if(len == 0 || memcmp(digest, msg.hash, sizeof(digest)) != 0) {
+      differs = 1;
+      msg.header.type = CHUNKSUM;
+      msg.header.size = 0;
+      msg.header.rc   = 0;
+      rc = sendMessage(s, &msg);
     }
+    else
+      *offset += len;
   }
+  close(fd);
 
-  pclose(find);
-  free(line);
+  if(rc <= 0)
+    return -1;
+  return differs;
+}
 
-  return 0;
+// send a file the daemon has a different copy of, reusing what still matches
+static int updateChanged(int s, const char *filename) {
+  struct stat st;
+  uint32_t    offset = 0;
+  int         rc;
+
+  if(stat(filename, &st) == 0 && st.st_size >= CHUNK_THRESHOLD) {
+    rc = compareChunks(s, filename, &offset);
+    if(rc <= 0)
+      return rc == 0 ? 1 : -1;
+    if(offset > 0)
+      fprintf(stderr, "/%s: first %lu bytes unchanged\n", filename,
+              (unsigned long)offset);
+  }
+
+  return update(s, filename, offset);
 }
 
-static int update(int s, const char *filename) {
-  FILE *fp;
-  int rc, rc2, flush;
-  z_stream strm;
+static int update(int s, const char *filename, uint32_t offset) {
+  int       fd, rc;
+  uLong     totalIn = 0, totalOut = 0;
   message_t msg;
+  struct stat st;
+#ifndef WIN32
+  long        threads;
+#endif
 
-  memset(&msg, 0, sizeof(msg));
-  memset(&strm, 0, sizeof(strm));
+  if(dryRun) {
+    if(stat(filename, &st) == 0) {
+      summary.files++;
+      summary.bytes += st.st_size - offset;
+    }
+    return 1;
+  }
 
-  fp = fopen(filename, "rb");
-  if(fp == NULL) {
-    fprintf(stderr, "fopen('%s'): %s\n", filename, strerror(errno));
+  fd = open(filename, O_RDONLY | O_BINARY);
+  if(fd == -1) {
+    fprintf(stderr, "open('%s'): %s\n", filename, strerror(errno));
+    skipFile(filename, errno == ENOENT);
+    return 1;
+  }
+
+  if(setPath(&msg, UPDATE, filename) == -1
+  || (offset > 0 && msg.header.size + 4 > sizeof(msg.data))) {
+    close(fd);
     return -1;
   }
 
-  msg.header.type = UPDATE;
-  msg.header.size = strlen(filename)+2;
-  msg.data[0] = '/';
-  memcpy(msg.data+1, filename, strlen(filename)+1);
+  // the daemon keeps the first offset bytes and appends the stream to them
+  if(offset > 0) {
+    msg.data[msg.header.size++] = offset >> 24;
+    msg.data[msg.header.size++] = offset >> 16;
+    msg.data[msg.header.size++] = offset >> 8;
+    msg.data[msg.header.size++] = offset;
+    if(lseek(fd, offset, SEEK_SET) != offset) {
+      fprintf(stderr, "lseek('%s'): %s\n", filename, strerror(errno));
+      close(fd);
+      skipFile(filename, 1);
+      return 1;
+    }
+  }
 
   rc = sendMessage(s, &msg);
   if(rc <= 0) {
-    fclose(fp);
+    close(fd);
+    return rc;
+  }
+
+#ifndef WIN32
+  // big files are worth spreading across every core
+  threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if(threads > 1 && fstat(fd, &st) == 0
+  && st.st_size - offset >= PARALLEL_THRESHOLD)
+    rc = deflateParallel(s, fd, offset, threads, &totalIn, &totalOut);
+  else
+#endif
+    rc = deflateSerial(s, fd, &totalIn, &totalOut);
+  close(fd);
+  if(rc <= 0)
+    return rc;
+
+  if(totalIn > 0)
+  {
+    printf("Compression ratio: %lu.%02lu\n",
+      totalOut/totalIn,
+      (totalOut * 100 / totalIn) % 100);
+  }
+  else
+    printf("Compression ratio: empty file\n");
+
+  // the daemon keeps the short copy until the retry replaces it
+  if(rc == READ_FAILED)
+    skipFile(filename, 1);
+
+  msg.header.size = 0;
+  rc = sendMessage(s, &msg);
+  if(rc <= 0)
     return rc;
+
+  return 1;
+}
+
+/* A file that went away or changed while we read it doesn't end the session.
+ * It is left out, and --watch tries it again with the next batch.
+ */
+static void skipFile(const char *path, int retry) {
+  skipped++;
+#ifdef __linux__
+  if(watchMode && retry && queueChange(path, 0) == 0) {
+    fprintf(stderr, "/%s: skipped; will try again\n", path);
+    return;
   }
+#endif
+  fprintf(stderr, "/%s: skipped\n", path);
+}
 
-  deflateInit(&strm, Z_BEST_COMPRESSION);
+static int deflateSerial(int s, int fd, uLong *totalIn, uLong *totalOut) {
+  int rc, rc2, flush = Z_NO_FLUSH, failed = 0;
+  ssize_t len;
+  z_stream *strm = &deflater;
+  message_t msg;
 
+  // the stream lives as long as the connection, so files don't reallocate it
+  if(!deflating) {
+    memset(strm, 0, sizeof(*strm));
+    rc = deflateInit2(strm, Z_BEST_COMPRESSION, Z_DEFLATED,
+                      profile.windowBits, profile.memLevel, Z_DEFAULT_STRATEGY);
+    if(rc != Z_OK) {
+      fprintf(stderr, "deflateInit2: %s\n", zError(rc));
+      return -1;
+    }
+    deflating = 1;
+  }
+  else if((rc = deflateReset(strm)) != Z_OK) {
+    fprintf(stderr, "deflateReset: %s\n", zError(rc));
+    return -1;
+  }
+
+  msg.header.type = UPDATE;
+  msg.header.rc   = 0;
   msg.header.size = 0;
-  strm.avail_in   = 0;
-  strm.avail_out = sizeof(msg.data);
-  strm.next_out  = msg.data;
+  strm->avail_in  = 0;
+  strm->avail_out = profile.frameSize;
+  strm->next_out  = msg.data;
 
   do {
     // need to grab more input
-    if(strm.avail_in == 0) {
-      rc = fread(buf, 1, sizeof(buf), fp);
-      if(ferror(fp)) {
-        deflateEnd(&strm);
-        fclose(fp);
-        return -1;
+    if(strm->avail_in == 0 && flush != Z_FINISH) {
+      len = read(fd, buf, sizeof(buf));
+      // end the stream early; the daemon gets a short copy for now
+      if(len == -1) {
+        fprintf(stderr, "read: %s\n", strerror(errno));
+        failed = 1;
+        len    = 0;
       }
-      flush = feof(fp) ? Z_FINISH : Z_NO_FLUSH;
-      strm.avail_in  = rc;
-      strm.next_in   = buf;
+      flush = len == 0 ? Z_FINISH : Z_NO_FLUSH;
+      strm->avail_in = len;
+      strm->next_in  = buf;
     }
 
-    rc = deflate(&strm, flush);
+    rc = deflate(strm, flush);
 
     // filled up the output buffer or finished compressing
-    if(strm.avail_out == 0 || rc == Z_STREAM_END) {
-      msg.header.size = strm.next_out - msg.data;
+    if(strm->avail_out == 0 || rc == Z_STREAM_END) {
+      msg.header.size = strm->next_out - msg.data;
       rc2 = sendMessage(s, &msg);
-      if(rc2 <= 0) {
-        fclose(fp);
-        deflateEnd(&strm);
+      if(rc2 <= 0)
         return rc2;
-      }
-      strm.avail_out = sizeof(msg.data);
-      strm.next_out  = msg.data;
+      strm->avail_out = profile.frameSize;
+      strm->next_out  = msg.data;
     }
   } while(rc == Z_OK);
 
-  if(strm.total_in > 0)
-  {
-    printf("Compression ratio: %lu.%02lu\n",
-      strm.total_out/strm.total_in,
-      (strm.total_out * 100 / strm.total_in) % 100);
+  *totalIn  = strm->total_in;
+  *totalOut = strm->total_out;
+
+  return failed ? READ_FAILED : 1;
+}
+
+#ifndef WIN32
+typedef struct {
+  int       s;
+  int       failed; // a frame couldn't be sent
+  message_t msg;
+} framer_t;
+
+// pack compressed output into full frames
+static int sendFrames(void *param, const unsigned char *data, size_t size) {
+  framer_t *framer = param;
+  size_t   len;
+
+  while(size > 0) {
+    len = profile.frameSize - framer->msg.header.size;
+    if(len > size)
+      len = size;
+    memcpy(framer->msg.data + framer->msg.header.size, data, len);
+    framer->msg.header.size += len;
+    data += len;
+    size -= len;
+
+    if(framer->msg.header.size == profile.frameSize) {
+      if(sendMessage(framer->s, &framer->msg) <= 0) {
+        framer->failed = 1;
+        return -1;
+      }
+      framer->msg.header.size = 0;
+    }
   }
-  else
-    printf("Compression ratio: empty file\n");
 
-  fclose(fp);
-  deflateEnd(&strm);
+  return 0;
+}
 
-  msg.header.size = 0;
-  rc = sendMessage(s, &msg);
-  if(rc <= 0)
-    return rc;
+static int deflateParallel(int s, int fd, uint32_t offset, int threads,
+                           uLong *totalIn, uLong *totalOut) {
+  framer_t framer;
+  int      rc;
 
-  return 1;
+  memset(&framer, 0, sizeof(framer));
+  framer.s = s;
+  framer.msg.header.type = UPDATE;
+
+  rc = pdeflate(fd, offset, Z_BEST_COMPRESSION, profile.windowBits,
+                profile.memLevel, threads, sendFrames, &framer,
+                totalIn, totalOut);
+  if(framer.failed)
+    return -1;
+
+  // anything else means the file couldn't be read; the daemon gets the
+  // stream so far and a short copy
+  if(framer.msg.header.size > 0) {
+    if(sendMessage(s, &framer.msg) <= 0)
+      return -1;
+  }
+
+  return rc == 0 ? 1 : READ_FAILED;
 }
+#endif
 
-static int md5sum(unsigned char *digest, const char *filename) {
-  FILE *fp;
-  MD5_CTX ctx;
-  int rc;
 
-  if(digest == NULL || filename == NULL) {
-    errno = EINVAL;
+#ifdef __linux__
+// quiet period before a batch of changes is sent
+#define DEBOUNCE_MS 250
+// upper bound on how long a batch may keep growing
+#define COALESCE_MS 2000
+#define WATCH_MASK  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE)
+
+typedef struct {
+  int  wd;
+  char *path;
+} watch_t;
+
+typedef struct {
+  char *path;
+  int  isdir;
+} change_t;
+
+static watch_t  *watches    = NULL;
+static size_t   numWatches  = 0;
+static change_t *changes    = NULL;
+static size_t   numChanges  = 0;
+
+static long msNow(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+static int addWatch(int fd, const char *path) {
+  int    wd;
+  size_t i;
+  char   *copy;
+  void   *p;
+
+  wd = inotify_add_watch(fd, path[0] ? path : ".", WATCH_MASK);
+  if(wd == -1) {
+    // it may have been removed already
+    if(errno == ENOENT)
+      return 0;
+    fprintf(stderr, "inotify_add_watch('%s'): %s\n", path, strerror(errno));
     return -1;
   }
 
-  fp = fopen(filename, "rb");
-  if(fp == NULL) {
+  copy = strdup(path);
+  if(copy == NULL)
     return -1;
+
+  // the same directory may be watched again after a rename
+  for(i = 0; i < numWatches; i++) {
+    if(watches[i].wd == wd) {
+      free(watches[i].path);
+      watches[i].path = copy;
+      return 0;
+    }
   }
 
-  MD5_Init(&ctx);
-  do {
-    rc = fread(buf, 1, sizeof(buf), fp);
-    if(rc > 0)
-      MD5_Update(&ctx, buf, rc);
-  } while(rc == sizeof(buf));
+  p = realloc(watches, (numWatches+1)*sizeof(*watches));
+  if(p == NULL) {
+    free(copy);
+    return -1;
+  }
+  watches = p;
+  watches[numWatches].wd   = wd;
+  watches[numWatches].path = copy;
+  numWatches++;
 
-  MD5_Final(digest, &ctx);
+  return 0;
+}
 
-  rc = 0;
-  if(ferror(fp))
-    rc = -1;
+static void removeWatch(int wd) {
+  size_t i;
+
+  for(i = 0; i < numWatches; i++) {
+    if(watches[i].wd == wd) {
+      free(watches[i].path);
+      watches[i] = watches[--numWatches];
+      return;
+    }
+  }
+}
+
+static const char* lookupWatch(int wd) {
+  size_t i;
 
-  fclose(fp);
+  for(i = 0; i < numWatches; i++) {
+    if(watches[i].wd == wd)
+      return watches[i].path;
+  }
+  return NULL;
+}
+
+static int queueChange(const char *path, int isdir) {
+  size_t i;
+  char   *copy;
+  void   *p;
+
+  for(i = 0; i < numChanges; i++) {
+    if(strcmp(changes[i].path, path) == 0) {
+      changes[i].isdir = isdir;
+      return 0;
+    }
+  }
+
+  copy = strdup(path);
+  if(copy == NULL)
+    return -1;
+
+  p = realloc(changes, (numChanges+1)*sizeof(*changes));
+  if(p == NULL) {
+    free(copy);
+    return -1;
+  }
+  changes = p;
+  changes[numChanges].path  = copy;
+  changes[numChanges].isdir = isdir;
+  numChanges++;
+
+  return 0;
+}
+
+static void clearChanges(void) {
+  size_t i;
+
+  for(i = 0; i < numChanges; i++)
+    free(changes[i].path);
+  numChanges = 0;
+}
+
+// watch a directory tree; optionally queue its contents for syncing
+static int watchTree(int fd, const char *dir, int queue) {
+  DIR           *dp;
+  struct dirent *ent;
+  struct stat   st;
+  char          path[PATH_MAX];
+  int           rc = 0;
+
+  dp = opendir(dir[0] ? dir : ".");
+  if(dp == NULL) {
+    // it may have been removed already
+    if(errno == ENOENT)
+      return 0;
+    fprintf(stderr, "opendir('%s'): %s\n", dir, strerror(errno));
+    return -1;
+  }
+
+  while(rc == 0 && (ent = readdir(dp)) != NULL) {
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+    // match 'find *', which skips hidden entries at the top level
+    if(dir[0] == 0 && ent->d_name[0] == '.')
+      continue;
+
+    joinPath(path, dir, ent->d_name);
+    if(lstat(path, &st) == -1)
+      continue;
+
+    if(S_ISDIR(st.st_mode)) {
+      rc = addWatch(fd, path);
+      if(rc == 0 && queue)
+        rc = queueChange(path, 1);
+      if(rc == 0)
+        rc = watchTree(fd, path, queue);
+    }
+    else if(S_ISREG(st.st_mode) && queue)
+      rc = queueChange(path, 0);
+  }
+
+  closedir(dp);
   return rc;
 }
 
+static int compareChanges(const void *a, const void *b) {
+  return strcmp(((const change_t*)a)->path, ((const change_t*)b)->path);
+}
+
+static int flushChanges(int s) {
+  struct stat st;
+  change_t    *pending = changes;
+  size_t      num = numChanges, i;
+  int         rc = 1;
+
+  // files skipped below are queued again, for the next batch
+  changes    = NULL;
+  numChanges = 0;
+
+  // sorting puts every directory ahead of its contents
+  qsort(pending, num, sizeof(*pending), compareChanges);
+
+  for(i = 0; i < num && rc > 0; i++) {
+    // skip anything that went away before we got to it
+    if(lstat(pending[i].path, &st) == -1)
+      continue;
+
+    if(pending[i].isdir && S_ISDIR(st.st_mode))
+      rc = sendMkdir(s, pending[i].path);
+    else if(!pending[i].isdir && S_ISREG(st.st_mode)) {
+      fprintf(stderr, "update /%s\n", pending[i].path);
+      rc = updateChanged(s, pending[i].path);
+    }
+  }
+
+  for(i = 0; i < num; i++)
+    free(pending[i].path);
+  free(pending);
+  return rc > 0 ? 0 : -1;
+}
+
+static int watch(int s) {
+  int           fd, rc, timeout;
+  int           overflow = 0;
+  long          first = 0;
+  ssize_t       len;
+  char          *p;
+  char          path[PATH_MAX];
+  const char    *dir;
+  struct pollfd pfd;
+  const struct inotify_event *ev;
+  char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+  fd = inotify_init();
+  if(fd == -1) {
+    perror("inotify_init");
+    return -1;
+  }
+
+  rc = addWatch(fd, "");
+  if(rc == 0)
+    rc = watchTree(fd, "", 0);
+  if(rc != 0) {
+    close(fd);
+    return -1;
+  }
+
+  printf("Watching for changes\n");
+  // files the first sync skipped wait for the usual debounce
+  first = msNow();
+
+  pfd.fd     = fd;
+  pfd.events = POLLIN;
+
+  while(1) {
+    if(numChanges == 0 && !overflow)
+      timeout = -1;
+    else {
+      timeout = COALESCE_MS - (msNow() - first);
+      if(timeout > DEBOUNCE_MS)
+        timeout = DEBOUNCE_MS;
+      if(timeout < 0)
+        timeout = 0;
+    }
+
+    rc = poll(&pfd, 1, timeout);
+    if(rc == -1) {
+      if(errno == EINTR)
+        continue;
+      perror("poll");
+      break;
+    }
+
+    if(rc == 0) {
+      // things have settled down; push the batch out
+      if(overflow) {
+        // we lost track of what changed, so fall back to a full sync
+        clearChanges();
+        overflow = 0;
+        rc = watchTree(fd, "", 0);
+        if(rc == 0)
+          rc = syncTree(s);
+      }
+      else
+        rc = flushChanges(s);
+      if(rc != 0)
+        break;
+      // anything skipped is tried again once things settle down
+      first = msNow();
+      printf("Watching for changes\n");
+      continue;
+    }
+
+    len = read(fd, events, sizeof(events));
+    if(len <= 0) {
+      if(len == -1 && errno == EINTR)
+        continue;
+      perror("read");
+      rc = -1;
+      break;
+    }
+
+    if(numChanges == 0 && !overflow)
+      first = msNow();
+
+    for(p = events; p < events + len; p += sizeof(*ev) + ev->len) {
+      ev = (const struct inotify_event*)p;
+
+      if(ev->mask & IN_Q_OVERFLOW) {
+        overflow = 1;
+        continue;
+      }
+      if(ev->mask & IN_IGNORED) {
+        removeWatch(ev->wd);
+        continue;
+      }
+
+      dir = lookupWatch(ev->wd);
+      if(dir == NULL || ev->len == 0)
+        continue;
+      if(dir[0] == 0 && ev->name[0] == '.')
+        continue;
+      joinPath(path, dir, ev->name);
+
+      rc = 0;
+      if(ev->mask & IN_ISDIR) {
+        // new directory; it may already have contents we never saw
+        rc = addWatch(fd, path);
+        if(rc == 0)
+          rc = queueChange(path, 1);
+        if(rc == 0)
+          rc = watchTree(fd, path, 1);
+      }
+      else if(ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO))
+        rc = queueChange(path, 0);
+
+      // a change we couldn't track is handled like a lost event
+      if(rc != 0 && !overflow) {
+        fprintf(stderr, "Lost track of '/%s', doing a full sync\n", path);
+        overflow = 1;
+      }
+    }
+  }
+
+  clearChanges();
+  close(fd);
+  return rc == 0 ? 0 : -1;
+}
+#endif
+
 #ifdef WIN32
 ssize_t getline(char **lineptr, size_t *n, FILE *stream) {
   static char  line[1024];
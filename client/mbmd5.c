@@ -0,0 +1,262 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <openssl/md5.h>
+#include "mbmd5.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// file data read for a lane at a time, plus room for the padding
+#define LANE_READ   (32*1024)
+#define LANE_BUFFER (LANE_READ + 128)
+
+static int hashSerial(const char *const *paths, unsigned char *const *digests,
+                      size_t count, size_t *failed);
+
+#ifdef __GNUC__
+#define F(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+#define G(x,y,z) ((y) ^ ((z) & ((x) ^ (y))))
+#define H(x,y,z) ((x) ^ (y) ^ (z))
+#define I(x,y,z) ((y) ^ ((x) | ~(z)))
+
+#define STEP(f,a,b,c,d,k,s,t) \
+  a += f(b,c,d) + m[k] + (uint32_t)(t); \
+  a  = b + ((a << s) | (a >> (32-s)))
+
+// SSE2 is part of x86-64; elsewhere the compiler does what it can
+#define NAME   md5x4
+#define LANES  4
+#define TARGET
+#include "mbmd5kernel.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define NAME   md5x8
+#define LANES  8
+#define TARGET __attribute__((target("avx2")))
+#include "mbmd5kernel.h"
+
+#define NAME   md5x16
+#define LANES  16
+#define TARGET __attribute__((target("avx512f")))
+#include "mbmd5kernel.h"
+#endif
+
+typedef void (*kernel_t)(uint32_t state[4][MBMD5_MAX_LANES],
+                         unsigned char *const *ptrs, size_t blocks);
+
+typedef struct {
+  int           fd;
+  size_t        file;   // index into paths
+  unsigned char *buf;
+  size_t        pos;    // next block to hash
+  size_t        len;    // bytes in buf
+  uint64_t      total;  // bytes read from the file
+  int           padded; // end of file reached and padding appended
+} lane_t;
+
+static kernel_t pickKernel(int *lanes) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if(__builtin_cpu_supports("avx512f")) {
+    *lanes = 16;
+    return md5x16;
+  }
+  if(__builtin_cpu_supports("avx2")) {
+    *lanes = 8;
+    return md5x8;
+  }
+#endif
+  *lanes = 4;
+  return md5x4;
+}
+
+// make sure the lane has a whole block to hash, unless the file is done
+static int fillLane(lane_t *lane) {
+  ssize_t rc;
+  size_t  i;
+
+  if(lane->padded || lane->len - lane->pos >= 64)
+    return 0;
+
+  memmove(lane->buf, lane->buf + lane->pos, lane->len - lane->pos);
+  lane->len -= lane->pos;
+  lane->pos  = 0;
+
+  while(lane->len < LANE_READ) {
+    rc = read(lane->fd, lane->buf + lane->len, LANE_READ - lane->len);
+    if(rc == -1 && errno == EINTR)
+      continue;
+    if(rc == -1)
+      return -1;
+    if(rc == 0)
+      break;
+    lane->len   += rc;
+    lane->total += rc;
+  }
+
+  if(lane->len < LANE_READ) {
+    // MD5 padding: a one bit, zeros, then the length in bits
+    lane->buf[lane->len++] = 0x80;
+    while(lane->len % 64 != 56)
+      lane->buf[lane->len++] = 0;
+    for(i = 0; i < 8; i++)
+      lane->buf[lane->len++] = (lane->total*8) >> (i*8);
+    lane->padded = 1;
+  }
+
+  return 0;
+}
+
+static int hashLanes(const char *const *paths, unsigned char *const *digests,
+                     size_t count, size_t *failed) {
+  static const uint32_t iv[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+  static kernel_t kernel;
+  static int      numLanes;
+  uint32_t        state[4][MBMD5_MAX_LANES];
+  unsigned char   *ptrs[MBMD5_MAX_LANES];
+  unsigned char   *mem;
+  lane_t          lanes[MBMD5_MAX_LANES];
+  lane_t          *lane;
+  size_t          next = 0, blocks, avail;
+  int             l, i, active, err, rc = 0;
+
+  if(kernel == NULL)
+    kernel = pickKernel(&numLanes);
+
+  // no file is to blame when the lane buffers can't be had, so don't fail
+  // the batch; hash it one file at a time instead
+  mem = malloc((size_t)numLanes * LANE_BUFFER);
+  if(mem == NULL)
+    return hashSerial(paths, digests, count, failed);
+
+  memset(state, 0, sizeof(state));
+  for(l = 0; l < numLanes; l++) {
+    lanes[l].fd  = -1;
+    lanes[l].buf = mem + (size_t)l * LANE_BUFFER;
+    ptrs[l]      = lanes[l].buf;
+  }
+
+  while(rc == 0) {
+    active = 0;
+    blocks = LANE_BUFFER / 64;
+
+    for(l = 0; l < numLanes && rc == 0; l++) {
+      lane = &lanes[l];
+      while(1) {
+        // hand an idle lane the next file
+        if(lane->fd == -1) {
+          if(next == count)
+            break;
+          lane->file   = next++;
+          lane->pos    = lane->len = lane->total = 0;
+          lane->padded = 0;
+          lane->fd     = open(paths[lane->file], O_RDONLY | O_BINARY);
+          if(lane->fd == -1) {
+            *failed = lane->file;
+            rc = -1;
+            break;
+          }
+          for(i = 0; i < 4; i++)
+            state[i][l] = iv[i];
+        }
+
+        if(fillLane(lane) == -1) {
+          *failed = lane->file;
+          rc = -1;
+          break;
+        }
+
+        if(lane->pos < lane->len)
+          break;
+
+        // every block of this file has been hashed
+        for(i = 0; i < 16; i++)
+          digests[lane->file][i] = state[i/4][l] >> ((i%4)*8);
+        close(lane->fd);
+        lane->fd = -1;
+      }
+
+      if(rc == 0 && lane->fd != -1) {
+        ptrs[l] = lane->buf + lane->pos;
+        avail   = (lane->len - lane->pos) / 64;
+        if(avail < blocks)
+          blocks = avail;
+        active++;
+      }
+      else
+        ptrs[l] = lane->buf;
+    }
+
+    if(rc != 0 || active == 0)
+      break;
+
+    // idle lanes hash whatever is in their buffer; the result is dropped
+    kernel(state, ptrs, blocks);
+    for(l = 0; l < numLanes; l++) {
+      if(lanes[l].fd != -1)
+        lanes[l].pos += blocks*64;
+    }
+  }
+
+  err = errno;
+  for(l = 0; l < numLanes; l++) {
+    if(lanes[l].fd != -1)
+      close(lanes[l].fd);
+  }
+  free(mem);
+  errno = err;
+
+  return rc;
+}
+#endif
+
+// one file at a time through OpenSSL
+static int hashSerial(const char *const *paths, unsigned char *const *digests,
+                      size_t count, size_t *failed) {
+  unsigned char buf[LANE_READ];
+  MD5_CTX       ctx;
+  ssize_t       rc;
+  size_t        i;
+  int           fd, err;
+
+  for(i = 0; i < count; i++) {
+    fd = open(paths[i], O_RDONLY | O_BINARY);
+    if(fd == -1) {
+      *failed = i;
+      return -1;
+    }
+
+    MD5_Init(&ctx);
+    while((rc = read(fd, buf, sizeof(buf))) != 0) {
+      if(rc == -1 && errno == EINTR)
+        continue;
+      if(rc == -1) {
+        err = errno;
+        close(fd);
+        errno   = err;
+        *failed = i;
+        return -1;
+      }
+      MD5_Update(&ctx, buf, rc);
+    }
+    MD5_Final(digests[i], &ctx);
+    close(fd);
+  }
+
+  return 0;
+}
+
+int mbmd5(const char *const *paths, unsigned char *const *digests,
+          size_t count, size_t *failed) {
+#ifdef __GNUC__
+  // lanes only pay off when there is more than one file to spread over them
+  if(count > 1)
+    return hashLanes(paths, digests, count, failed);
+#endif
+  return hashSerial(paths, digests, count, failed);
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <stddef.h>
+
+// most streams hashed side by side (AVX-512)
+#define MBMD5_MAX_LANES 16
+
+/* Compute the md5sum of every file in paths, storing each one in the
+ * matching entry of digests. Several files are hashed at once, one per lane
+ * of the widest vector unit the CPU has; the digests are the same as
+ * hashing each file on its own. Returns -1 with errno set and *failed set to
+ * the index of the offending file if one can't be read.
+ */
+int mbmd5(const char *const *paths, unsigned char *const *digests,
+          size_t count, size_t *failed);
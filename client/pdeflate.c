@@ -0,0 +1,281 @@
+#ifndef WIN32
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <zlib.h>
+#include "pdeflate.h"
+
+enum {
+  SLOT_FREE,
+  SLOT_BUSY,
+  SLOT_DONE,
+  SLOT_ERROR,
+};
+
+typedef struct {
+  unsigned char *data;
+  size_t        size;   // compressed bytes in data
+  size_t        alloc;
+  size_t        length; // uncompressed bytes of the block
+  uLong         adler;
+  int           state;
+} slot_t;
+
+typedef struct {
+  int             fd;
+  off_t           offset;   // where in the file the stream starts
+  off_t           fileSize; // bytes after offset
+  int             level;
+  int             windowBits;
+  int             memLevel;
+  size_t          numBlocks;
+  size_t          next;     // next block to hand out
+  size_t          sent;     // blocks already emitted
+  size_t          numSlots;
+  slot_t          *slots;
+  int             abort;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+} job_t;
+
+// returns 1 if the file ends early, as when it shrinks while we read it
+static int readFull(int fd, unsigned char *buf, size_t size, off_t offset) {
+  ssize_t rc;
+
+  while(size > 0) {
+    rc = pread(fd, buf, size, offset);
+    if(rc == -1 && errno == EINTR)
+      continue;
+    if(rc == 0)
+      return 1;
+    if(rc == -1)
+      return -1;
+    buf    += rc;
+    size   -= rc;
+    offset += rc;
+  }
+
+  return 0;
+}
+
+static int compressBlock(job_t *job, z_stream *strm, unsigned char *in,
+                         size_t idx, slot_t *slot) {
+  size_t dictSize = (size_t)1 << job->windowBits;
+  size_t dictLen, need;
+  off_t  start;
+  int    last, rc;
+  void   *p;
+
+  start = (off_t)idx * PDEFLATE_BLOCK_SIZE;
+  slot->length = PDEFLATE_BLOCK_SIZE;
+  if(job->fileSize - start < PDEFLATE_BLOCK_SIZE)
+    slot->length = job->fileSize - start;
+  dictLen = start < dictSize ? start : dictSize;
+
+  // read the block along with the tail of the one before it
+  rc = readFull(job->fd, in, dictLen + slot->length,
+                job->offset + start - dictLen);
+  if(rc != 0) {
+    fprintf(stderr, "pread: %s\n", rc == -1 ? strerror(errno) : "File shrank");
+    return -1;
+  }
+  slot->adler = adler32(adler32(0L, Z_NULL, 0), in + dictLen, slot->length);
+
+  deflateReset(strm);
+  if(dictLen > 0)
+    deflateSetDictionary(strm, in, dictLen);
+
+  // leave room for the empty stored block a sync flush appends
+  need = deflateBound(strm, slot->length) + 16;
+  if(slot->alloc < need) {
+    p = realloc(slot->data, need);
+    if(p == NULL)
+      return -1;
+    slot->data  = p;
+    slot->alloc = need;
+  }
+
+  last = (idx == job->numBlocks-1);
+  strm->next_in   = in + dictLen;
+  strm->avail_in  = slot->length;
+  strm->next_out  = slot->data;
+  strm->avail_out = slot->alloc;
+
+  // a sync flush ends on a byte boundary, so blocks can simply be joined
+  rc = deflate(strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+  if((last && rc != Z_STREAM_END) || (!last && rc != Z_OK)
+  || strm->avail_in != 0 || strm->avail_out == 0) {
+    fprintf(stderr, "deflate: %s\n", strm->msg ? strm->msg : zError(rc));
+    return -1;
+  }
+
+  slot->size = slot->alloc - strm->avail_out;
+  return 0;
+}
+
+static void* worker(void *param) {
+  job_t         *job = param;
+  z_stream      strm;
+  unsigned char *in;
+  slot_t        *slot;
+  size_t        idx;
+  int           rc;
+
+  memset(&strm, 0, sizeof(strm));
+  in = malloc(((size_t)1 << job->windowBits) + PDEFLATE_BLOCK_SIZE);
+  rc = deflateInit2(&strm, job->level, Z_DEFLATED, -job->windowBits,
+                    job->memLevel, Z_DEFAULT_STRATEGY);
+
+  pthread_mutex_lock(&job->lock);
+  if(in == NULL || rc != Z_OK) {
+    fprintf(stderr, "pdeflate: Failed to initialize worker\n");
+    job->abort = 1;
+    pthread_cond_broadcast(&job->cond);
+  }
+
+  while(1) {
+    // don't run further ahead than there are slots to hold the output
+    while(!job->abort && job->next < job->numBlocks
+    && job->next >= job->sent + job->numSlots)
+      pthread_cond_wait(&job->cond, &job->lock);
+    if(job->abort || job->next >= job->numBlocks)
+      break;
+
+    idx  = job->next++;
+    slot = &job->slots[idx % job->numSlots];
+    slot->state = SLOT_BUSY;
+    pthread_mutex_unlock(&job->lock);
+
+    rc = compressBlock(job, &strm, in, idx, slot);
+
+    pthread_mutex_lock(&job->lock);
+    slot->state = rc == 0 ? SLOT_DONE : SLOT_ERROR;
+    pthread_cond_broadcast(&job->cond);
+  }
+  pthread_mutex_unlock(&job->lock);
+
+  deflateEnd(&strm);
+  free(in);
+  return NULL;
+}
+
+int pdeflate(int fd, off_t offset, int level, int windowBits, int memLevel,
+             int threads, pdeflate_emit_t emit, void *param,
+             uLong *totalIn, uLong *totalOut) {
+  job_t         job;
+  struct stat   st;
+  pthread_t     *tids;
+  slot_t        *slot;
+  unsigned char header[2], trailer[4];
+  uLong         adler;
+  size_t        i;
+  int           started, rc = 0;
+
+  if(fstat(fd, &st) == -1) {
+    fprintf(stderr, "fstat: %s\n", strerror(errno));
+    return -1;
+  }
+
+  memset(&job, 0, sizeof(job));
+  job.fd         = fd;
+  job.offset     = offset;
+  job.fileSize   = st.st_size > offset ? st.st_size - offset : 0;
+  job.level      = level;
+  job.windowBits = windowBits;
+  job.memLevel   = memLevel;
+  job.numBlocks  = (job.fileSize + PDEFLATE_BLOCK_SIZE - 1) / PDEFLATE_BLOCK_SIZE;
+  job.numSlots   = threads*2;
+  if(job.numBlocks == 0)
+    job.numBlocks = 1;
+
+  job.slots = calloc(job.numSlots, sizeof(*job.slots));
+  tids = calloc(threads, sizeof(*tids));
+  if(job.slots == NULL || tids == NULL) {
+    free(job.slots);
+    free(tids);
+    return -1;
+  }
+  pthread_mutex_init(&job.lock, NULL);
+  pthread_cond_init(&job.cond, NULL);
+
+  // zlib header, the same one deflate() writes for this window and level
+  if(level == Z_DEFAULT_COMPRESSION)
+    level = 6;
+  header[0] = ((windowBits - 8) << 4) | Z_DEFLATED;
+  header[1] = (level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3) << 6;
+  header[1] += 31 - ((header[0] << 8) + header[1]) % 31;
+  if(emit(param, header, sizeof(header)))
+    rc = -1;
+  *totalOut = sizeof(header);
+  *totalIn  = 0;
+
+  for(started = 0; started < threads && rc == 0; started++) {
+    if(pthread_create(&tids[started], NULL, worker, &job)) {
+      fprintf(stderr, "pthread_create: Failed to start worker\n");
+      rc = -1;
+      break;
+    }
+  }
+
+  adler = adler32(0L, Z_NULL, 0);
+  for(i = 0; i < job.numBlocks && rc == 0; i++) {
+    slot = &job.slots[i % job.numSlots];
+
+    pthread_mutex_lock(&job.lock);
+    while(!job.abort && slot->state != SLOT_DONE && slot->state != SLOT_ERROR)
+      pthread_cond_wait(&job.cond, &job.lock);
+    if(job.abort || slot->state == SLOT_ERROR)
+      rc = -1;
+    pthread_mutex_unlock(&job.lock);
+    if(rc != 0)
+      break;
+
+    if(emit(param, slot->data, slot->size)) {
+      rc = -1;
+      break;
+    }
+    adler      = adler32_combine(adler, slot->adler, slot->length);
+    *totalIn  += slot->length;
+    *totalOut += slot->size;
+
+    pthread_mutex_lock(&job.lock);
+    slot->state = SLOT_FREE;
+    job.sent++;
+    pthread_cond_broadcast(&job.cond);
+    pthread_mutex_unlock(&job.lock);
+  }
+
+  pthread_mutex_lock(&job.lock);
+  if(rc != 0)
+    job.abort = 1;
+  pthread_cond_broadcast(&job.cond);
+  pthread_mutex_unlock(&job.lock);
+
+  while(started-- > 0)
+    pthread_join(tids[started], NULL);
+
+  if(rc == 0) {
+    trailer[0] = adler >> 24;
+    trailer[1] = adler >> 16;
+    trailer[2] = adler >> 8;
+    trailer[3] = adler;
+    if(emit(param, trailer, sizeof(trailer)))
+      rc = -1;
+    *totalOut += sizeof(trailer);
+  }
+
+  for(i = 0; i < job.numSlots; i++)
+    free(job.slots[i].data);
+  free(job.slots);
+  free(tids);
+  pthread_mutex_destroy(&job.lock);
+  pthread_cond_destroy(&job.cond);
+
+  return rc;
+}
+#endif
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <zlib.h>
+
+// input handed to each compression thread
+#define PDEFLATE_BLOCK_SIZE (128*1024)
+
+// receives the compressed stream in order; returns 0 to keep going
+typedef int (*pdeflate_emit_t)(void *param, const unsigned char *data, size_t size);
+
+/* Compress the file behind fd, from offset to the end, into a single zlib
+ * stream using several threads. The file is split into blocks which are
+ * deflated independently, each primed with the tail of the block before it,
+ * so the output inflates like any other zlib stream.
+ */
+int pdeflate(int fd, off_t offset, int level, int windowBits, int memLevel,
+             int threads,
+             pdeflate_emit_t emit, void *param,
+             uLong *totalIn, uLong *totalOut);
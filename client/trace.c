@@ -0,0 +1,325 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "message.h"
+#include "trace.h"
+
+#define RECORD_SIZE 9
+
+static FILE     *trace;
+static int      tracePayload;
+static uint64_t lastRecord;
+
+static const char *typeNames[] = {
+  "MD5SUM", "UPDATE", "MKDIR", "DIRHASH", "HELLO", "LIST", "DELETE", "CHUNKSUM",
+};
+
+static uint64_t now(void) {
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec*1000000 + tv.tv_usec;
+}
+
+static const char* typeName(uint8_t type) {
+  static char str[8];
+
+  if(type < sizeof(typeNames)/sizeof(typeNames[0]))
+    return typeNames[type];
+  snprintf(str, sizeof(str), "%u", type);
+  return str;
+}
+
+int traceOpen(const char *path, int payload) {
+  unsigned char header[6];
+
+  trace = fopen(path, "wb");
+  if(trace == NULL) {
+    fprintf(stderr, "fopen('%s'): %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  memcpy(header, TRACE_MAGIC, 4);
+  header[4] = TRACE_VERSION;
+  header[5] = payload ? TRACE_PAYLOAD : 0;
+  if(fwrite(header, sizeof(header), 1, trace) != 1) {
+    fprintf(stderr, "fwrite('%s'): %s\n", path, strerror(errno));
+    fclose(trace);
+    trace = NULL;
+    return -1;
+  }
+
+  tracePayload = payload;
+  lastRecord   = now();
+  return 0;
+}
+
+void traceMessage(char dir, const struct message *msg) {
+  unsigned char record[RECORD_SIZE];
+  uint64_t      t, delta;
+
+  if(trace == NULL)
+    return;
+
+  t     = now();
+  delta = t - lastRecord;
+  if(delta > UINT32_MAX)
+    delta = UINT32_MAX;
+  lastRecord = t;
+
+  record[0] = delta >> 24;
+  record[1] = delta >> 16;
+  record[2] = delta >> 8;
+  record[3] = delta;
+  record[4] = dir;
+  record[5] = msg->header.size >> 8;
+  record[6] = msg->header.size;
+  record[7] = msg->header.type;
+  record[8] = msg->header.rc;
+
+  if(fwrite(record, sizeof(record), 1, trace) != 1
+  || (tracePayload && msg->header.size > 0
+   && fwrite(msg->data, msg->header.size, 1, trace) != 1)) {
+    fprintf(stderr, "trace: %s; recording stopped\n", strerror(errno));
+    fclose(trace);
+    trace = NULL;
+    return;
+  }
+
+  // a reply ends an exchange, so keep the file current for --watch
+  if(dir == 'r')
+    fflush(trace);
+}
+
+void traceClose(void) {
+  if(trace != NULL)
+    fclose(trace);
+  trace = NULL;
+}
+
+static FILE* openTrace(const char *path, int *flags) {
+  unsigned char header[6];
+  FILE          *fp;
+
+  fp = fopen(path, "rb");
+  if(fp == NULL) {
+    fprintf(stderr, "fopen('%s'): %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  if(fread(header, sizeof(header), 1, fp) != 1
+  || memcmp(header, TRACE_MAGIC, 4) != 0 || header[4] != TRACE_VERSION) {
+    fprintf(stderr, "%s: Not a trace\n", path);
+    fclose(fp);
+    return NULL;
+  }
+
+  *flags = header[5];
+  return fp;
+}
+
+// returns 1 for a record, 0 at the end of the trace and -1 if it is cut short
+static int readRecord(FILE *fp, int flags, uint32_t *delta, char *dir,
+                      message_t *msg) {
+  unsigned char record[RECORD_SIZE];
+  int           c;
+
+  c = fgetc(fp);
+  if(c == EOF)
+    return 0;
+  ungetc(c, fp);
+
+  if(fread(record, sizeof(record), 1, fp) != 1)
+    return -1;
+
+  *delta = ((uint32_t)record[0] << 24) | (record[1] << 16)
+         | (record[2] << 8) | record[3];
+  *dir   = record[4];
+  msg->header.size = (record[5] << 8) | record[6];
+  msg->header.type = record[7];
+  msg->header.rc   = record[8];
+
+  if(msg->header.size > sizeof(msg->data))
+    return -1;
+  memset(msg->data, 0, sizeof(msg->data));
+  if((flags & TRACE_PAYLOAD) && msg->header.size > 0
+  && fread(msg->data, msg->header.size, 1, fp) != 1)
+    return -1;
+
+  return 1;
+}
+
+typedef struct {
+  uint64_t      waited;
+  uint64_t      bytes;
+  unsigned long sent;
+  unsigned long received;
+  unsigned long mismatches;
+} replay_t;
+
+static int replayRecv(int s, message_t *reply, replay_t *st) {
+  uint64_t t;
+
+  t = now();
+  if(recvMessage(s, reply) <= 0) {
+    fprintf(stderr, "replay: Daemon hung up after %lu messages\n",
+            st->sent + st->received);
+    return -1;
+  }
+  st->waited += now() - t;
+  st->bytes  += sizeof(reply->header) + reply->header.size;
+  st->received++;
+  return 0;
+}
+
+static void replayCheck(const message_t *msg, const message_t *reply,
+                        replay_t *st) {
+  if(reply->header.type != msg->header.type || reply->header.rc != msg->header.rc
+  || reply->header.size != msg->header.size) {
+    if(st->mismatches++ < 10) {
+      fprintf(stderr, "reply %lu: expected %s size %u rc %d, got %s size %u rc %d\n",
+              st->received, typeName(msg->header.type), msg->header.size,
+              msg->header.rc, typeName(reply->header.type), reply->header.size,
+              reply->header.rc);
+    }
+  }
+}
+
+int traceReplay(int s, const char *path, double speed) {
+  FILE      *fp;
+  message_t msg, reply;
+  replay_t  st;
+  uint64_t  start, recorded = 0, recordedWait = 0, target, t;
+  uint32_t  delta;
+  char      dir;
+  int       flags, rc;
+  int       streaming = 0, stopped = 0, ended = 0;
+
+  fp = openTrace(path, &flags);
+  if(fp == NULL)
+    return -1;
+
+  if(!(flags & TRACE_PAYLOAD)) {
+    fprintf(stderr, "%s: Recorded without payloads; use --record to replay it\n",
+            path);
+    fclose(fp);
+    return -1;
+  }
+
+  memset(&st, 0, sizeof(st));
+  start = now();
+  while((rc = readRecord(fp, flags, &delta, &dir, &msg)) == 1) {
+    recorded += delta;
+
+    if(dir == 's') {
+      // keep to the recorded pace, but never wait to catch up
+      if(speed > 0) {
+        target = start + (uint64_t)(recorded / speed);
+        t = now();
+        if(target > t)
+          usleep(target - t);
+      }
+
+      // a CHUNKSUM reply is a stream, which the client may stop early
+      if(msg.header.type == CHUNKSUM && msg.header.size > 0) {
+        streaming = 1;
+        stopped   = ended = 0;
+      }
+      else if(streaming && msg.header.type == CHUNKSUM)
+        stopped = 1;
+
+      st.bytes += sizeof(msg.header) + msg.header.size;
+      if(sendMessage(s, &msg) <= 0) {
+        rc = -1;
+        break;
+      }
+      st.sent++;
+      continue;
+    }
+
+    recordedWait += delta;
+
+    if(streaming) {
+      // how many digests follow the stop depends on timing, so only the
+      // empty frame that ends the stream is matched against the recording
+      if(msg.header.size > 0 && (stopped || ended))
+        continue;
+      // the daemon's stream already ended early
+      if(ended) {
+        streaming = 0;
+        continue;
+      }
+    }
+
+    if(replayRecv(s, &reply, &st) == -1) {
+      rc = -1;
+      break;
+    }
+
+    if(streaming && msg.header.size == 0) {
+      // the daemon's copy is longer than the recorded one
+      if(reply.header.size > 0 && !stopped)
+        replayCheck(&msg, &reply, &st);
+      while(reply.header.size > 0 && (rc = replayRecv(s, &reply, &st)) == 0)
+        ;
+      if(rc == -1)
+        break;
+      rc = 1;
+      streaming = 0;
+    }
+    else if(streaming && reply.header.size == 0)
+      ended = 1;
+
+    replayCheck(&msg, &reply, &st);
+  }
+  fclose(fp);
+
+  if(rc == -1) {
+    fprintf(stderr, "replay: %s is damaged or the daemon went away\n", path);
+    return -1;
+  }
+
+  printf("Replayed %lu messages (%lu sent, %lu received, %llu bytes) in %.3fs"
+         " (recorded %.3fs)\n", st.sent + st.received, st.sent, st.received,
+         (unsigned long long)st.bytes, (now() - start) / 1e6, recorded / 1e6);
+  printf("Waited %.3fs for replies (recorded %.3fs); %lu mismatched replies\n",
+         st.waited / 1e6, recordedWait / 1e6, st.mismatches);
+
+  return st.mismatches ? -1 : 0;
+}
+
+int traceDump(const char *path) {
+  FILE      *fp;
+  message_t msg;
+  uint64_t  t = 0;
+  uint32_t  delta;
+  char      dir;
+  int       flags, rc;
+
+  fp = openTrace(path, &flags);
+  if(fp == NULL)
+    return -1;
+
+  printf("%12s %3s %-7s %5s %4s\n", "time (ms)", "dir", "type", "size", "rc");
+  while((rc = readRecord(fp, flags, &delta, &dir, &msg)) == 1) {
+    t += delta;
+    printf("%12.3f %3s %-7s %5u %4d", t / 1e3, dir == 's' ? "->" : "<-",
+           typeName(msg.header.type), msg.header.size, msg.header.rc);
+    // paths are the one payload worth showing
+    if((flags & TRACE_PAYLOAD) && dir == 's' && msg.header.type != UPDATE
+    && msg.header.type != HELLO && msg.header.size > 0)
+      printf(" %.*s", (int)msg.header.size, (char*)msg.data);
+    printf("\n");
+  }
+  fclose(fp);
+
+  if(rc == -1) {
+    fprintf(stderr, "%s: Trace is cut short\n", path);
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+struct message;
+
+/* A trace is a short file header (TRACE_MAGIC, a version byte and a flags
+ * byte) followed by one record per message:
+ *
+ *   microseconds since the previous record (4 bytes, big-endian),
+ *   direction ('s' sent or 'r' received),
+ *   the message header as it goes over the wire (4 bytes),
+ *   the payload, if the trace was recorded with TRACE_PAYLOAD
+ */
+#define TRACE_MAGIC   "FSTR"
+#define TRACE_VERSION 1
+#define TRACE_PAYLOAD 0x01
+
+// start recording every message to path; payload = 0 keeps only headers
+int  traceOpen(const char *path, int payload);
+void traceMessage(char dir, const struct message *msg);
+void traceClose(void);
+
+/* Send the recorded messages to the daemon on s, waiting for each recorded
+ * reply. A CHUNKSUM stream counts as one reply, since how many digests
+ * follow a stop depends on timing. speed scales the recorded pacing; 0 sends
+ * as fast as possible.
+ */
+int  traceReplay(int s, const char *path, double speed);
+
+// print a trace, one message per line
+int  traceDump(const char *path);
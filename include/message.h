@@ -9,30 +9,104 @@
 #define swiWaitForVBlank() ((void)0)
 #endif
 
+// called when a socket only managed part of a transfer
+#ifndef IO_WAIT
+#define IO_WAIT() swiWaitForVBlank()
+#endif
+
+// called when a non-blocking socket can't move anything; nonzero gives up
+#ifndef IO_BLOCKED
+#define IO_BLOCKED() (IO_WAIT(), 0)
+#endif
+
+// called with every whole message sent ('s') or received ('r')
+#ifndef TRACE_MESSAGE
+#define TRACE_MESSAGE(dir, msg) ((void)0)
+#endif
+
 #ifdef WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
 #define ECONNRESET WSAECONNRESET
+#ifndef EWOULDBLOCK
+#define EWOULDBLOCK WSAEWOULDBLOCK
+#endif
 #else
 #include <arpa/inet.h>
 #include <sys/socket.h>
 #endif
 
+/* A directory hash (DIRHASH) is the MD5 over the directory's regular files
+ * and subdirectories, sorted by name with strcmp(). Each child contributes
+ * its name including the terminating NUL, a type byte ('f' or 'd'), and its
+ * 16-byte digest: the file's md5sum or the subdirectory's own hash.
+ * A reply with no data means the directory does not exist, and a one-byte
+ * reply of DIRHASH_FILE means there is a file in its place.
+ */
+#define DIRHASH_FILE 'f'
+#define DIRHASH_DIR  'd'
+
+/* HELLO negotiates the codec profile. The client sends an empty HELLO and the
+ * daemon answers with its profile: the bytes it has set aside for codec
+ * state, and the largest windowBits and frame it accepts. The client then
+ * sends back the profile it picked, which the daemon acknowledges.
+ */
+#define MIN_WINDOW_BITS 9
+
+// memory inflate needs for a window plus its state, with some headroom
+#define INFLATE_MEMORY(windowBits) ((1UL << (windowBits)) + 8*1024)
+
+/* LIST streams the entries of a directory, sorted by name with strcmp(),
+ * packed into as few frames as possible and ended by an empty frame. Each
+ * entry is a LIST_ENTRY_SIZE header followed by its name (no NUL):
+ *
+ *   type (DIRHASH_FILE or DIRHASH_DIR), name length,
+ *   size (4 bytes, big-endian), mtime (4 bytes, big-endian),
+ *   digest (16 bytes; the md5sum of a file or the DIRHASH of a directory)
+ */
+#define LIST_ENTRY_SIZE 26
+
+/* CHUNKSUM compares a file a chunk at a time. The daemon streams the md5sum
+ * of each CHUNKSUM_SIZE bytes in its own frame, without waiting, and ends
+ * with an empty frame once the file ends (or at once if it does not exist).
+ * The client may send an empty CHUNKSUM at any point to make the daemon stop
+ * early; it still reads up to the empty frame. A stop that arrives after the
+ * daemon has finished is ignored.
+ *
+ * An UPDATE may carry a 4-byte big-endian offset after the path's NUL. The
+ * daemon keeps that many bytes of the existing file and writes the stream
+ * after them.
+ */
+#define CHUNKSUM_SIZE (64*1024)
+
 typedef enum {
-  MD5SUM = 0,
-  UPDATE = 1,
-  MKDIR  = 2,
+  MD5SUM   = 0,
+  UPDATE   = 1,
+  MKDIR    = 2,
+  DIRHASH  = 3,
+  HELLO    = 4,
+  LIST     = 5,
+  DELETE   = 6,
+  CHUNKSUM = 7,
 } message_type_t;
 
 typedef struct {
+  uint32_t memory;
+  uint8_t  windowBits;
+  uint8_t  memLevel;
+  uint16_t frameSize;
+} profile_t;
+
+typedef struct message {
   struct {
     uint16_t size;
     uint8_t  type;
     int8_t   rc;
   } header;
   union {
-    uint8_t data[1024];
-    uint8_t hash[16];
+    uint8_t   data[1024];
+    uint8_t   hash[16];
+    profile_t profile;
   };
 } message_t;
 
@@ -48,6 +122,11 @@ static inline int RECV(int s, char *buf, size_t size) {
 
     rc = recv(s, &buf[recvd], toRecv, 0);
     if(rc == -1) {
+      if(errno == EWOULDBLOCK) { // non-blocking socket with nothing yet
+        if(IO_BLOCKED())
+          return 0;
+        continue;
+      }
       if(errno == ECONNRESET)
         return 0;
       fprintf(stderr, "recv: %s\n", strerror(errno));
@@ -58,7 +137,7 @@ static inline int RECV(int s, char *buf, size_t size) {
     else
       recvd += rc;
     if(recvd != size)
-      swiWaitForVBlank();
+      IO_WAIT();
   }
 
   return recvd;
@@ -76,6 +155,11 @@ static inline int SEND(int s, char *buf, size_t size) {
 
     rc = send(s, &buf[sent], toSend, 0);
     if(rc == -1) {
+      if(errno == EWOULDBLOCK) { // non-blocking socket that is full
+        if(IO_BLOCKED())
+          return 0;
+        continue;
+      }
       if(errno == ECONNRESET)
         return 0;
       fprintf(stderr, "send: %s\n", strerror(errno));
@@ -86,7 +170,7 @@ static inline int SEND(int s, char *buf, size_t size) {
     else
       sent += rc;
     if(sent != size)
-      swiWaitForVBlank();
+      IO_WAIT();
   }
 
   return sent;
@@ -103,11 +187,14 @@ static inline int recvMessage(int s, message_t *msg) {
   rc = RECV(s, (char*)msg->data, msg->header.size);
   if(rc == -1)
     return rc;
+  if(rc == msg->header.size)
+    TRACE_MESSAGE('r', msg);
 
   return sizeof(msg->header) + rc;
 }
 
 static inline int sendMessage(int s, message_t *msg) {
+  TRACE_MESSAGE('s', msg);
   msg->header.size = htons(msg->header.size);
   return SEND(s, (char*)&msg->header, sizeof(msg->header) + ntohs(msg->header.size));
 }
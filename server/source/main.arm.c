@@ -1,44 +1,235 @@
 #include <feos.h>
 #include <multifeos.h>
 #include <dswifi9.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <md5.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 #include <zlib.h>
+
+static void budgetWait(void);
+static int  budgetBlocked(void);
+#define IO_WAIT()    budgetWait()
+#define IO_BLOCKED() budgetBlocked()
 #include "message.h"
 
 typedef int socklen_t;
 #define perror(x) fprintf(stderr, x ": %s\n", strerror(errno))
 
 static const int yes = 1;
-static const int no  = 0;
 
-static unsigned char buf[1024];
+// bytes set aside up front for decompression
+#define DEFAULT_CODEC_BUDGET (48*1024)
+#define MIN_WRITE_BUFFER     1024
+
+// fixed arena that all codec state comes from
+typedef struct {
+  uint8_t *base;
+  size_t  size;
+  size_t  used;
+  size_t  peak;
+} arena_t;
+
+static size_t codecBudget = DEFAULT_CODEC_BUDGET;
+
+// how long to work before giving the foreground a turn
+#define DEFAULT_SLICE_USEC 4000
+// hardware timer pair used to measure slices
+#define BUDGET_TIMER       2
+
+typedef enum {
+  BUDGET_FIXED, // work one slice per frame, then wait for vblank
+  BUDGET_AUTO,  // yield after each slice; keep going if nobody else runs
+  BUDGET_FULL,  // never yield
+} budget_mode_t;
+
+static const char *budgetModes[] = { "fixed", "auto", "full", };
+
+typedef struct {
+  budget_mode_t mode;
+  u32           sliceUsec;
+  u32           start;    // timer ticks when the running thread resumed
+} budget_t;
+
+static budget_t budget = {
+  .mode      = BUDGET_AUTO,
+  .sliceUsec = DEFAULT_SLICE_USEC,
+};
+
+typedef struct {
+  uint64_t busyUsec; // time spent working this session
+  u32      slices;   // slices that ran to the end
+  u32      yields;   // times we stepped aside
+} usage_t;
+
+// clients that can be served at once
+#define DEFAULT_SESSIONS 3
+
+// one directory entry from readNames()
+typedef struct {
+  size_t  off;      // where the name starts in names_t.data
+  uint8_t type;     // DIRHASH_DIR, DIRHASH_FILE or 0, filled in by hashDir()
+  uint8_t hash[16]; // filled in by hashDir()
+} name_t;
 
-static int  process(int s);
-static void getHash(message_t *msg);
-static int  update(int s, message_t *msg);
+/* Directory listings for a session, kept as a stack: a nested readNames()
+ * pushes above its caller's names and freeNames() pops them again. The
+ * buffers grow as needed and are kept for the next client.
+ */
+typedef struct {
+  char   *data; // names back to back, each with its NUL
+  size_t used;
+  size_t size;
+  name_t *ents;
+  size_t count;
+  size_t alloc;
+} names_t;
+
+// the names one readNames() call pushed
+typedef struct {
+  size_t first;
+  size_t count;
+  size_t mark; // names.used before the push
+} namelist_t;
+
+typedef struct {
+  int           s;
+  thread_t      thread;
+  volatile bool done;
+  message_t     msg;
+  uint8_t       buf[1024];
+  char          locked[sizeof(((message_t*)NULL)->data)]; // path in use
+  arena_t       arena;
+  profile_t     profile;
+  usage_t       usage;
+  names_t       names;
+  z_stream      strm;      // kept across files and reset for each one
+  bool          inflating; // strm is initialized for the current profile
+  uint8_t       *out;      // write buffer, carved from the arena with strm
+  size_t        outSize;
+} session_t;
+
+static session_t *sessions      = NULL;
+static int       numSessions    = DEFAULT_SESSIONS;
+static int       activeSessions = 0;
+
+/* Cached DIRHASH results. Foreground apps write to the card too, so each
+ * entry keeps a stamp of the names, sizes and mtimes below the directory and
+ * is only used while the stamp still matches.
+ */
+typedef struct dirhash {
+  struct dirhash *next;
+  uint8_t        hash[16];
+  uint8_t        stamp[16];
+  char           path[];
+} dirhash_t;
+
+// heap the cache may use; the least recently used entry goes first
+#define DIRHASH_CACHE_BYTES (32*1024)
+
+static dirhash_t *dirHashes    = NULL;
+static size_t    dirHashBytes  = 0;
+// bumped on every invalidation so stale results are never cached
+static u32       dirHashGeneration = 0;
+
+static int  initSessions(void);
+static void freeSessions(void);
+static int  session(void *param);
+static void lockPath(session_t *ss, const char *path);
+static void unlockPath(session_t *ss);
+static int  process(session_t *ss);
+static void getHash(session_t *ss, message_t *msg);
+static void getDirHash(session_t *ss, message_t *msg);
+static int  hashFile(session_t *ss, const char *path, uint8_t *digest);
+static int  chunkSum(session_t *ss, message_t *msg);
+static int  hashDir(session_t *ss, char *path, size_t size, uint8_t *digest,
+                     uint8_t *stamp);
+static void dropDirHash(dirhash_t **p);
+static void freeDirHashes(void);
+static void put32(uint8_t *p, uint32_t value);
+static int  readNames(session_t *ss, const char *path, namelist_t *list);
+static const char* nameAt(session_t *ss, const namelist_t *list, size_t i);
+static name_t* entAt(session_t *ss, const namelist_t *list, size_t i);
+static void freeNames(session_t *ss, const namelist_t *list);
+static int  list(session_t *ss, message_t *msg);
+static void removePath(session_t *ss, message_t *msg);
+static void invalidateDirHash(const char *path);
+static void negotiate(session_t *ss, message_t *msg);
+static void budgetStart(session_t *ss);
+static void budgetCheck(session_t *ss);
+static void budgetReport(session_t *ss);
+static int  recvBudgeted(session_t *ss, message_t *msg);
+static int  waitRequest(session_t *ss);
+static int  update(session_t *ss, message_t *msg);
+static int  codecStart(session_t *ss);
+static void codecEnd(session_t *ss);
 
 static volatile thread_t daemon = NULL;
 static volatile bool     quit   = false;
+static u32               quitWaits = 0;
 static volatile int      status = -1;
 
 int feosync(void *param);
 
 int main(int argc, char *argv[]) {
+  int i;
+
   if(argc == 1 || (argv[1] && stricmp(argv[1], "start") == 0)) {
     if(daemon != NULL) { // daemon is already running
       printf("FeOSync Daemon is already running\n");
       return 0;
     }
 
+    for(i = 2; i < argc; i++) {
+      if(strcmp(argv[i], "-m") == 0 && i+1 < argc)
+        codecBudget = strtoul(argv[++i], NULL, 0) * 1024;
+      else if(strcmp(argv[i], "-n") == 0 && i+1 < argc)
+        numSessions = strtol(argv[++i], NULL, 0);
+      else if(strcmp(argv[i], "-t") == 0 && i+1 < argc)
+        budget.sliceUsec = strtoul(argv[++i], NULL, 0);
+      else if(strcmp(argv[i], "-s") == 0 && i+1 < argc) {
+        i++;
+        for(budget.mode = BUDGET_FIXED; budget.mode <= BUDGET_FULL; budget.mode++) {
+          if(stricmp(argv[i], budgetModes[budget.mode]) == 0)
+            break;
+        }
+        if(budget.mode > BUDGET_FULL) {
+          fprintf(stderr, "Unknown scheduling mode '%s'\n", argv[i]);
+          return 1;
+        }
+      }
+      else {
+        fprintf(stderr, "Usage: %s start [-m <KB>] [-n <sessions>] [-t <usec>]"
+                        " [-s fixed|auto|full]\n", argv[0]);
+        return 1;
+      }
+    }
+    if(numSessions < 1) {
+      fprintf(stderr, "There must be at least 1 session\n");
+      return 1;
+    }
+    if(budget.sliceUsec == 0) {
+      fprintf(stderr, "Time slice must be at least 1us\n");
+      return 1;
+    }
+    if(codecBudget < INFLATE_MEMORY(MIN_WINDOW_BITS) + MIN_WRITE_BUFFER) {
+      fprintf(stderr, "Codec budget must be at least %luKB\n",
+              (INFLATE_MEMORY(MIN_WINDOW_BITS) + MIN_WRITE_BUFFER + 1023) / 1024);
+      return 1;
+    }
+
     // start the daemon
+    quit      = false;
+    quitWaits = 0;
     LdrBeginResidency();
     printf("FeOSync Daemon starting\n");
     daemon = FeOS_CreateThread(DEFAULT_STACK_SIZE, feosync, NULL);
@@ -75,14 +266,20 @@ int main(int argc, char *argv[]) {
 }
 
 int feosync(void *param) {
-  int  rc, s, listener, broadcaster;
+  int  rc, s, listener, broadcaster, i;
+  session_t          *ss;
   struct sockaddr_in addr;
   socklen_t          addrlen;
   struct in_addr     ip, netmask;
 
+  // set aside the codec arenas before anything else can fragment the heap
+  if(initSessions() == -1)
+    return (status = 1);
+
   // initialize wifi
   if(!Wifi_Startup()) {
     fprintf(stderr, "Wifi Failed to initialize\n");
+    freeSessions();
     return (status = 1);
   }
 
@@ -94,6 +291,7 @@ int feosync(void *param) {
   if(listener == -1) {
     perror("socket");
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -103,6 +301,7 @@ int feosync(void *param) {
     perror("socket");
     closesocket(listener);
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -115,6 +314,7 @@ int feosync(void *param) {
     closesocket(listener);
     closesocket(broadcaster);
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -128,6 +328,7 @@ int feosync(void *param) {
     closesocket(listener);
     closesocket(broadcaster);
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -139,6 +340,7 @@ int feosync(void *param) {
     closesocket(listener);
     closesocket(broadcaster);
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -149,6 +351,7 @@ int feosync(void *param) {
     closesocket(listener);
     closesocket(broadcaster);
     Wifi_Cleanup();
+    freeSessions();
     return (status = 1);
   }
 
@@ -168,6 +371,22 @@ int feosync(void *param) {
     for(rc = 0; rc < 60; rc++)
       swiWaitForVBlank();
 
+    // clean up after finished sessions and find a free one
+    ss = NULL;
+    for(i = 0; i < numSessions; i++) {
+      if(sessions[i].thread != NULL && sessions[i].done) {
+        FeOS_ThreadJoin(sessions[i].thread);
+        sessions[i].thread = NULL;
+        activeSessions--;
+      }
+      if(sessions[i].thread == NULL && ss == NULL)
+        ss = &sessions[i];
+    }
+
+    // all busy; leave new connections waiting in the backlog
+    if(ss == NULL)
+      continue;
+
     // accept a connection
     s = accept(listener, (struct sockaddr*)&addr, &addrlen);
     if(s == -1 && errno != EWOULDBLOCK) {
@@ -175,192 +394,1056 @@ int feosync(void *param) {
       closesocket(listener);
       closesocket(broadcaster);
       Wifi_Cleanup();
+      freeSessions();
       return 1;
     }
 
     if(s != -1) {
-      // set connection to blocking
-      rc = ioctl(s, FIONBIO, (char*)&no);
+      // sessions take turns on the CPU, so none of them may block
+      rc = ioctl(s, FIONBIO, (char*)&yes);
       if(rc == -1) {
         perror("ioctl");
         closesocket(listener);
         closesocket(broadcaster);
         closesocket(s);
         Wifi_Cleanup();
+        freeSessions();
         return 1;
       }
 
-      rc = process(s);
-      if(rc == -1) {
-        closesocket(listener);
-        closesocket(broadcaster);
+      ss->s    = s;
+      ss->done = false;
+      ss->thread = FeOS_CreateThread(DEFAULT_STACK_SIZE, session, ss);
+      if(ss->thread == NULL) {
+        fprintf(stderr, "Failed to start session\n");
         closesocket(s);
-        Wifi_Cleanup();
-        return 1;
       }
-      closesocket(s);
+      else
+        activeSessions++;
     }
   }
 
   closesocket(listener);
   closesocket(broadcaster);
   Wifi_Cleanup();
+  freeSessions();
   return 0;
 }
 
-int process(int s) {
-  int rc;
-  static message_t msg;
+int initSessions(void) {
+  int i;
+
+  sessions = calloc(numSessions, sizeof(*sessions));
+  if(sessions == NULL) {
+    fprintf(stderr, "Failed to allocate %d sessions\n", numSessions);
+    return -1;
+  }
+
+  for(i = 0; i < numSessions; i++) {
+    sessions[i].arena.base = malloc(codecBudget);
+    if(sessions[i].arena.base == NULL) {
+      fprintf(stderr, "Failed to allocate %u byte codec arena\n",
+              (unsigned int)codecBudget);
+      freeSessions();
+      return -1;
+    }
+    sessions[i].arena.size = codecBudget;
+  }
+
+  // sessions measure their slices with it; freeSessions() stops it again
+  cpuStartTiming(BUDGET_TIMER);
+  return 0;
+}
+
+void freeSessions(void) {
+  int i;
+
+  // let running syncs finish first
+  for(i = 0; i < numSessions; i++) {
+    if(sessions[i].thread != NULL) {
+      FeOS_ThreadJoin(sessions[i].thread);
+      sessions[i].thread = NULL;
+    }
+    free(sessions[i].arena.base);
+    free(sessions[i].names.data);
+    free(sessions[i].names.ents);
+  }
+
+  free(sessions);
+  // the module stays resident, so leave no timers running behind us
+  cpuEndTiming();
+  // nor carry hashes over to the next start
+  freeDirHashes();
+  sessions       = NULL;
+  activeSessions = 0;
+}
+
+int session(void *param) {
+  session_t *ss = param;
+  int       rc;
+
+  rc = process(ss);
+  codecEnd(ss);
+  unlockPath(ss);
+  closesocket(ss->s);
+  ss->done = true;
+
+  return rc;
+}
+
+void lockPath(session_t *ss, const char *path) {
+  int i;
+
+  // threads are cooperative, so nothing else runs between the check and
+  // the claim below
+  for(i = 0; i < numSessions; i++) {
+    if(&sessions[i] != ss && strcmp(sessions[i].locked, path) == 0) {
+      budgetWait();
+      i = -1;
+    }
+  }
+
+  strcpy(ss->locked, path);
+}
+
+void unlockPath(session_t *ss) {
+  ss->locked[0] = 0;
+}
+
+int process(session_t *ss) {
+  int       rc;
+  int       s    = ss->s;
+  message_t *msg = &ss->msg;
+
+  // until the client says otherwise, use the biggest window that fits
+  ss->profile.windowBits = MAX_WBITS;
+  while(INFLATE_MEMORY(ss->profile.windowBits) + MIN_WRITE_BUFFER > ss->arena.size)
+    ss->profile.windowBits--;
+  ss->profile.frameSize = sizeof(msg->data);
+  ss->arena.peak = 0;
+  budgetStart(ss);
 
   while(1) {
-    rc = recvMessage(s, &msg);
-    if(rc <= 0)
+    rc = waitRequest(ss);
+    if(rc > 0)
+      rc = recvBudgeted(ss, msg);
+    if(rc <= 0) {
+      printf("Codec memory used: %u of %u bytes\n",
+             (unsigned int)ss->arena.peak, (unsigned int)ss->arena.size);
+      budgetReport(ss);
       return rc;
+    }
 
-    switch(msg.header.type) {
+    switch(msg->header.type) {
+      case HELLO:
+        negotiate(ss, msg);
+        rc = sendMessage(s, msg);
+        if(rc <= 0)
+          return rc;
+        break;
       case MD5SUM:
-        printf("hash %s\n", msg.data);
-        getHash(&msg);
-        rc = sendMessage(s, &msg);
+        printf("hash %s\n", msg->data);
+        getHash(ss, msg);
+        rc = sendMessage(s, msg);
+        if(rc <= 0)
+          return rc;
+        break;
+      case CHUNKSUM:
+        // a stop that came in after the digests were all sent
+        if(msg->header.size == 0)
+          break;
+        printf("chunksum %s\n", msg->data);
+        rc = chunkSum(ss, msg);
+        if(rc <= 0)
+          return rc;
+        break;
+      case DIRHASH:
+        printf("dirhash %s\n", msg->data);
+        getDirHash(ss, msg);
+        rc = sendMessage(s, msg);
         if(rc <= 0)
           return rc;
         break;
       case UPDATE:
-        printf("update %s\n", msg.data);
-        rc = update(s, &msg);
+        printf("update %s\n", msg->data);
+        // update() reuses msg for the file data, so the lock keeps the path
+        lockPath(ss, (char*)msg->data);
+        invalidateDirHash(ss->locked);
+        rc = update(ss, msg);
+        invalidateDirHash(ss->locked);
+        unlockPath(ss);
+        if(rc <= 0)
+          return rc;
+        break;
+      case LIST:
+        printf("list %s\n", msg->data);
+        rc = list(ss, msg);
+        if(rc <= 0)
+          return rc;
+        break;
+      case DELETE:
+        printf("delete %s\n", msg->data);
+        removePath(ss, msg);
+        rc = sendMessage(s, msg);
         if(rc <= 0)
           return rc;
         break;
       case MKDIR:
-        printf("mkdir %s\n", msg.data);
-        rc = mkdir((char*)msg.data, 0755);
+        printf("mkdir %s\n", msg->data);
+        invalidateDirHash((char*)msg->data);
+        rc = mkdir((char*)msg->data, 0755);
         if(rc == -1 && errno != EEXIST) {
-          fprintf(stderr, "mkdir('%s'): %s\n", msg.data, strerror(errno));
-          msg.header.rc = -1;
-          msg.header.size = 0;
-          rc = sendMessage(s, &msg);
+          fprintf(stderr, "mkdir('%s'): %s\n", msg->data, strerror(errno));
+          msg->header.rc = -1;
+          msg->header.size = 0;
+          rc = sendMessage(s, msg);
           if(rc <= 0)
             return rc;
         }
         else {
-          msg.header.rc = 0;
-          msg.header.size = 0;
-          rc = sendMessage(s, &msg);
+          msg->header.rc = 0;
+          msg->header.size = 0;
+          rc = sendMessage(s, msg);
           if(rc <= 0)
             return rc;
         }
         break;
       default:
-        fprintf(stderr, "Invalid message type (%d)\n", msg.header.type);
+        fprintf(stderr, "Invalid message type (%d)\n", msg->header.type);
         return -1;
         break;
     }
   }
 }
 
-void getHash(message_t *msg) {
-  MD5_CTX ctx;
-  FILE    *fp;
-  int     rc;
+void getHash(session_t *ss, message_t *msg) {
+  if(hashFile(ss, (char*)msg->data, msg->hash) == -1) {
+    if(errno == ENOENT)
+      msg->header.rc = 0;
+    else
+      msg->header.rc = -1;
+    msg->header.size = 0;
+    return;
+  }
+
+  msg->header.rc = 0;
+  msg->header.size = sizeof(msg->hash);
+}
 
-  if((fp = fopen((char*)msg->data, "rb")) == NULL) {
+void getDirHash(session_t *ss, message_t *msg) {
+  struct stat st;
+  char        path[sizeof(msg->data)];
+  uint8_t     stamp[16];
+
+  if(stat((char*)msg->data, &st) == -1) {
     if(errno == ENOENT)
       msg->header.rc = 0;
     else {
-      fprintf(stderr, "fopen: '%s': %s\n", msg->data, strerror(errno));
+      fprintf(stderr, "stat: '%s': %s\n", msg->data, strerror(errno));
       msg->header.rc = -1;
     }
     msg->header.size = 0;
     return;
   }
+  else if(!S_ISDIR(st.st_mode)) {
+    // not an error; the client decides whether to replace it
+    msg->header.rc = 0;
+    msg->header.size = 1;
+    msg->data[0] = DIRHASH_FILE;
+    return;
+  }
 
-  if(!MD5_Init(&ctx)) {
-    fprintf(stderr, "MD5_Init: '%s': Failed to initialize\n", msg->data);
-    fclose(fp);
+  // hashDir() builds child paths in place, so give it room to grow
+  strcpy(path, (char*)msg->data);
+  if(hashDir(ss, path, sizeof(path), msg->hash, stamp) == -1) {
     msg->header.rc = -1;
     msg->header.size = 0;
     return;
   }
-  while((rc = fread(buf, 1, sizeof(buf), fp)) > 0) {
-    MD5_Update(&ctx, buf, rc);
-    FeOS_Yield();
+
+  msg->header.rc = 0;
+  msg->header.size = sizeof(msg->hash);
+}
+
+int hashFile(session_t *ss, const char *path, uint8_t *digest) {
+  MD5_CTX ctx;
+  int     fd, rc;
+
+  // don't hash a file another session is halfway through writing
+  lockPath(ss, path);
+
+  if((fd = open(path, O_RDONLY)) == -1) {
+    if(errno != ENOENT)
+      fprintf(stderr, "open: '%s': %s\n", path, strerror(errno));
+    unlockPath(ss);
+    return -1;
+  }
+
+  if(!MD5_Init(&ctx)) {
+    fprintf(stderr, "MD5_Init: '%s': Failed to initialize\n", path);
+    close(fd);
+    unlockPath(ss);
+    errno = EIO;
+    return -1;
+  }
+  while((rc = read(fd, ss->buf, sizeof(ss->buf))) > 0) {
+    MD5_Update(&ctx, ss->buf, rc);
+    budgetCheck(ss);
+  }
+  if(rc == -1) {
+    fprintf(stderr, "read: '%s': %s\n", path, strerror(errno));
+    close(fd);
+    unlockPath(ss);
+    return -1;
+  }
+  if(!MD5_Final(digest, &ctx)) {
+    fprintf(stderr, "MD5_Update: '%s': Failed to finalize\n", path);
+    close(fd);
+    unlockPath(ss);
+    errno = EIO;
+    return -1;
+  }
+
+  unlockPath(ss);
+  if(close(fd)) {
+    fprintf(stderr, "close: '%s': %s\n", path, strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+int chunkSum(session_t *ss, message_t *msg) {
+  MD5_CTX ctx;
+  size_t  len, want;
+  char    c;
+  int     fd, rc, done, err = 0;
+
+  // msg is reused for the replies, so the lock keeps the path
+  lockPath(ss, (char*)msg->data);
+
+  if((fd = open(ss->locked, O_RDONLY)) == -1) {
+    if(errno != ENOENT)
+      fprintf(stderr, "open: '%s': %s\n", ss->locked, strerror(errno));
+    msg->header.rc = errno == ENOENT ? 0 : -1;
+    msg->header.size = 0;
+    unlockPath(ss);
+    return sendMessage(ss->s, msg);
+  }
+
+  while(1) {
+    // the client sends a stop as soon as it sees a chunk that differs
+    if(recv(ss->s, &c, 1, MSG_PEEK) == 1) {
+      rc = recvBudgeted(ss, msg);
+      if(rc <= 0)
+        break;
+      if(msg->header.type != CHUNKSUM) {
+        fprintf(stderr, "chunksum: '%s': Unexpected message (%d)\n",
+                ss->locked, msg->header.type);
+        rc = -1;
+        break;
+      }
+      len = 0;
+    }
+    else {
+      MD5_Init(&ctx);
+      len = 0;
+      while(len < CHUNKSUM_SIZE) {
+        want = CHUNKSUM_SIZE - len;
+        if(want > sizeof(ss->buf))
+          want = sizeof(ss->buf);
+        rc = read(fd, ss->buf, want);
+        if(rc <= 0) {
+          err = rc == -1;
+          break;
+        }
+        MD5_Update(&ctx, ss->buf, rc);
+        len += rc;
+        budgetCheck(ss);
+      }
+      MD5_Final(msg->hash, &ctx);
+    }
+
+    // an empty frame ends the stream, whether at the end of file or a stop
+    msg->header.type = CHUNKSUM;
+    msg->header.rc   = err ? -1 : 0;
+    msg->header.size = len > 0 && !err ? sizeof(msg->hash) : 0;
+    done = msg->header.size == 0;
+    rc = sendMessage(ss->s, msg);
+    if(rc <= 0 || done)
+      break;
+  }
+
+  close(fd);
+  unlockPath(ss);
+  return rc;
+}
+
+/* The DIRHASH of path, and its stamp: an MD5 over the name, type, size and
+ * mtime of everything below it. One walk with stat() yields both, along
+ * with the hashes of the subdirectories; files are only read once the stamp
+ * shows the cached hash can't be used.
+ */
+int hashDir(session_t *ss, char *path, size_t size, uint8_t *digest,
+            uint8_t *stamp) {
+  struct stat st;
+  dirhash_t   *cache, **p;
+  MD5_CTX     ctx;
+  namelist_t  names;
+  name_t      *ent;
+  const char  *name;
+  size_t      len, i, need;
+  uint8_t     child[16];
+  uint8_t     info[9];
+  u32         generation = dirHashGeneration;
+  int         rc = 0;
+
+  if(readNames(ss, path, &names) == -1)
+    return -1;
+
+  len = strlen(path);
+  MD5_Init(&ctx);
+  for(i = 0; i < names.count && rc == 0; i++) {
+    name = nameAt(ss, &names, i);
+    if(len + 1 + strlen(name) + 1 > size) {
+      fprintf(stderr, "hashDir: '%s/%s': Path too long\n", path, name);
+      rc = -1;
+      break;
+    }
+    if(path[len-1] != '/')
+      strcat(path, "/");
+    strcat(path, name);
+
+    info[0] = 0;
+    if(stat(path, &st) == 0) {
+      if(S_ISDIR(st.st_mode)) {
+        info[0] = DIRHASH_DIR;
+        rc = hashDir(ss, path, size, digest, child);
+      }
+      else if(S_ISREG(st.st_mode))
+        info[0] = DIRHASH_FILE;
+    }
+    path[len] = 0;
+
+    // the recursion may have moved the names
+    ent  = entAt(ss, &names, i);
+    name = nameAt(ss, &names, i);
+    ent->type = info[0];
+    if(rc == 0 && info[0] != 0) {
+      put32(info+1, S_ISREG(st.st_mode) ? st.st_size : 0);
+      put32(info+5, st.st_mtime);
+      MD5_Update(&ctx, name, strlen(name)+1);
+      MD5_Update(&ctx, info, sizeof(info));
+      if(info[0] == DIRHASH_DIR) {
+        MD5_Update(&ctx, child, sizeof(child));
+        memcpy(ent->hash, digest, sizeof(ent->hash));
+      }
+    }
+    budgetCheck(ss);
+  }
+  MD5_Final(stamp, &ctx);
+
+  for(p = &dirHashes; rc == 0 && (cache = *p) != NULL; p = &cache->next) {
+    if(strcmp(cache->path, path) != 0)
+      continue;
+
+    if(memcmp(cache->stamp, stamp, sizeof(cache->stamp)) != 0) {
+      dropDirHash(p);
+      break;
+    }
+
+    // keep recently used entries at the front
+    *p = cache->next;
+    cache->next = dirHashes;
+    dirHashes   = cache;
+    memcpy(digest, cache->hash, sizeof(cache->hash));
+    freeNames(ss, &names);
+    return 0;
+  }
+
+  // subdirectories were hashed on the way; only the files are left
+  MD5_Init(&ctx);
+  for(i = 0; i < names.count && rc == 0; i++) {
+    ent  = entAt(ss, &names, i);
+    name = nameAt(ss, &names, i);
+    if(ent->type == DIRHASH_FILE) {
+      if(path[len-1] != '/')
+        strcat(path, "/");
+      strcat(path, name);
+      rc = hashFile(ss, path, ent->hash);
+      path[len] = 0;
+    }
+
+    if(rc == 0 && ent->type != 0) {
+      MD5_Update(&ctx, name, strlen(name)+1);
+      MD5_Update(&ctx, &ent->type, 1);
+      MD5_Update(&ctx, ent->hash, sizeof(ent->hash));
+    }
+    budgetCheck(ss);
+  }
+  MD5_Final(digest, &ctx);
+  freeNames(ss, &names);
+
+  if(rc != 0)
+    return rc;
+
+  // something was written while we were hashing; don't trust the result
+  if(generation != dirHashGeneration)
+    return 0;
+
+  // make room by dropping the least recently used entries
+  need = sizeof(*cache) + len + 1;
+  while(dirHashes != NULL && dirHashBytes + need > DIRHASH_CACHE_BYTES) {
+    for(p = &dirHashes; (*p)->next != NULL; p = &(*p)->next)
+      ;
+    dropDirHash(p);
+  }
+
+  cache = malloc(need);
+  if(cache != NULL) {
+    memcpy(cache->hash, digest, sizeof(cache->hash));
+    memcpy(cache->stamp, stamp, sizeof(cache->stamp));
+    strcpy(cache->path, path);
+    cache->next = dirHashes;
+    dirHashes = cache;
+    dirHashBytes += need;
+  }
+
+  return 0;
+}
+
+static const char* nameAt(session_t *ss, const namelist_t *list, size_t i) {
+  return ss->names.data + ss->names.ents[list->first + i].off;
+}
+
+static name_t* entAt(session_t *ss, const namelist_t *list, size_t i) {
+  return &ss->names.ents[list->first + i];
+}
+
+// qsort() doesn't yield, so no other session can change this meanwhile
+static const char *sortNames;
+
+static int compareNames(const void *a, const void *b) {
+  return strcmp(sortNames + ((const name_t*)a)->off,
+                sortNames + ((const name_t*)b)->off);
+}
+
+// directory entries sorted with strcmp(), without "." and ".."
+int readNames(session_t *ss, const char *path, namelist_t *list) {
+  names_t       *names = &ss->names;
+  DIR           *dp;
+  struct dirent *ent;
+  size_t        len, grow;
+  void          *p;
+
+  list->first = names->count;
+  list->count = 0;
+  list->mark  = names->used;
+
+  if((dp = opendir(path)) == NULL) {
+    fprintf(stderr, "opendir: '%s': %s\n", path, strerror(errno));
+    return -1;
   }
-  if(!MD5_Final(msg->hash, &ctx)) {
-    fprintf(stderr, "MD5_Update: '%s': Failed to finalize\n", msg->data);
-    fclose(fp);
+
+  while((ent = readdir(dp)) != NULL) {
+    if(strcmp(ent->d_name, ".") == 0 || strcmp(ent->d_name, "..") == 0)
+      continue;
+
+    // grow geometrically; the space is reused by every later listing
+    len = strlen(ent->d_name) + 1;
+    if(names->used + len > names->size) {
+      for(grow = names->size ? names->size : 1024; grow < names->used + len; )
+        grow *= 2;
+      if((p = realloc(names->data, grow)) == NULL)
+        break;
+      names->data = p;
+      names->size = grow;
+    }
+    if(names->count == names->alloc) {
+      grow = names->alloc ? names->alloc*2 : 64;
+      if((p = realloc(names->ents, grow*sizeof(*names->ents))) == NULL)
+        break;
+      names->ents  = p;
+      names->alloc = grow;
+    }
+
+    names->ents[names->count++].off = names->used;
+    memcpy(names->data + names->used, ent->d_name, len);
+    names->used += len;
+    list->count++;
+  }
+  closedir(dp);
+
+  if(ent != NULL) {
+    fprintf(stderr, "readNames: '%s': Out of memory\n", path);
+    freeNames(ss, list);
+    return -1;
+  }
+
+  sortNames = names->data;
+  qsort(names->ents + list->first, list->count, sizeof(*names->ents),
+        compareNames);
+  return 0;
+}
+
+void freeNames(session_t *ss, const namelist_t *list) {
+  ss->names.count = list->first;
+  ss->names.used  = list->mark;
+}
+
+static void put32(uint8_t *p, uint32_t value) {
+  p[0] = value >> 24;
+  p[1] = value >> 16;
+  p[2] = value >> 8;
+  p[3] = value;
+}
+
+int list(session_t *ss, message_t *msg) {
+  struct stat st;
+  char        path[sizeof(msg->data)];
+  namelist_t  names;
+  size_t      len, nameLen, pos = 0, i;
+  uint8_t     digest[16];
+  uint8_t     stamp[16];
+  uint8_t     *entry;
+  uint8_t     type;
+  int         rc;
+
+  strcpy(path, (char*)msg->data);
+  if(readNames(ss, path, &names) == -1) {
     msg->header.rc = -1;
     msg->header.size = 0;
+    return sendMessage(ss->s, msg);
+  }
+
+  len = strlen(path);
+  msg->header.rc = 0;
+  for(i = 0; i < names.count; i++) {
+    nameLen = strlen(nameAt(ss, &names, i));
+    if(nameLen > 255 || len + 1 + nameLen + 1 > sizeof(path))
+      continue;
+    if(path[len-1] != '/')
+      strcat(path, "/");
+    strcat(path, nameAt(ss, &names, i));
+
+    rc = 0;
+    if(stat(path, &st) == -1)
+      type = 0;
+    else if(S_ISDIR(st.st_mode)) {
+      type = DIRHASH_DIR;
+      rc = hashDir(ss, path, sizeof(path), digest, stamp);
+    }
+    else if(S_ISREG(st.st_mode)) {
+      type = DIRHASH_FILE;
+      rc = hashFile(ss, path, digest);
+    }
+    else
+      type = 0;
+    path[len] = 0;
+    if(type == 0 || rc != 0)
+      continue;
+
+    // this entry won't fit; send what we have so far
+    if(pos + LIST_ENTRY_SIZE + nameLen > sizeof(msg->data)) {
+      msg->header.size = pos;
+      rc = sendMessage(ss->s, msg);
+      if(rc <= 0) {
+        freeNames(ss, &names);
+        return rc;
+      }
+      pos = 0;
+    }
+
+    entry = msg->data + pos;
+    entry[0] = type;
+    entry[1] = nameLen;
+    put32(entry+2, type == DIRHASH_FILE ? st.st_size : 0);
+    put32(entry+6, st.st_mtime);
+    memcpy(entry+10, digest, sizeof(digest));
+    memcpy(entry+LIST_ENTRY_SIZE, nameAt(ss, &names, i), nameLen);
+    pos += LIST_ENTRY_SIZE + nameLen;
+  }
+  freeNames(ss, &names);
+
+  if(pos > 0) {
+    msg->header.size = pos;
+    rc = sendMessage(ss->s, msg);
+    if(rc <= 0)
+      return rc;
+  }
+
+  // an empty frame ends the listing
+  msg->header.size = 0;
+  return sendMessage(ss->s, msg);
+}
+
+void removePath(session_t *ss, message_t *msg) {
+  struct stat st;
+  int         rc;
+
+  lockPath(ss, (char*)msg->data);
+  if(stat(ss->locked, &st) == 0 && S_ISDIR(st.st_mode))
+    rc = rmdir(ss->locked);
+  else
+    rc = unlink(ss->locked);
+
+  if(rc == -1 && errno != ENOENT) {
+    fprintf(stderr, "delete: '%s': %s\n", ss->locked, strerror(errno));
+    msg->header.rc = -1;
+  }
+  else
+    msg->header.rc = 0;
+  msg->header.size = 0;
+
+  invalidateDirHash(ss->locked);
+  unlockPath(ss);
+}
+
+void invalidateDirHash(const char *path) {
+  dirhash_t **p = &dirHashes, *cache;
+  size_t    len;
+
+  dirHashGeneration++;
+
+  // drop the entry for path and for every directory above it
+  while((cache = *p) != NULL) {
+    len = strlen(cache->path);
+    if(len > 0 && cache->path[len-1] == '/')
+      len--;
+    if(strncmp(cache->path, path, len) == 0
+    && (path[len] == '/' || path[len] == 0))
+      dropDirHash(p);
+    else
+      p = &cache->next;
+  }
+}
+
+// unlink *p from the cache and free it
+void dropDirHash(dirhash_t **p) {
+  dirhash_t *cache = *p;
+
+  *p = cache->next;
+  dirHashBytes -= sizeof(*cache) + strlen(cache->path) + 1;
+  free(cache);
+}
+
+void freeDirHashes(void) {
+  while(dirHashes != NULL)
+    dropDirHash(&dirHashes);
+}
+
+void negotiate(session_t *ss, message_t *msg) {
+  size_t windowBits, frameSize;
+
+  // advertise what we can handle; keep back room for the write buffer
+  if(msg->header.size == 0) {
+    msg->profile.memory     = htonl(ss->arena.size - MIN_WRITE_BUFFER);
+    msg->profile.windowBits = MAX_WBITS;
+    msg->profile.memLevel   = 0;
+    msg->profile.frameSize  = htons(sizeof(msg->data));
+    msg->header.rc   = 0;
+    msg->header.size = sizeof(msg->profile);
     return;
   }
 
-  if(fclose(fp)) {
-    fprintf(stderr, "fclose: '%s': %s\n", msg->data, strerror(errno));
+  // accept the client's choice if it fits
+  windowBits = msg->profile.windowBits;
+  frameSize  = ntohs(msg->profile.frameSize);
+  if(msg->header.size != sizeof(msg->profile)
+  || windowBits < MIN_WINDOW_BITS || windowBits > MAX_WBITS
+  || INFLATE_MEMORY(windowBits) + MIN_WRITE_BUFFER > ss->arena.size
+  || frameSize == 0 || frameSize > sizeof(msg->data)) {
+    fprintf(stderr, "Rejected codec profile\n");
     msg->header.rc = -1;
     msg->header.size = 0;
     return;
   }
 
+  // the inflate state was sized for the old window
+  codecEnd(ss);
+  ss->profile.windowBits = windowBits;
+  ss->profile.memLevel   = msg->profile.memLevel;
+  ss->profile.frameSize  = frameSize;
+  printf("Codec profile: windowBits=%d frameSize=%d\n",
+         ss->profile.windowBits, ss->profile.frameSize);
+
   msg->header.rc = 0;
-  msg->header.size = sizeof(msg->hash);
+  msg->header.size = 0;
 }
 
-int update(int s, message_t *msg) {
-  FILE *fp;
-  int  rc;
-  z_stream strm;
+static void* arenaAlloc(arena_t *arena, size_t size) {
+  void *p;
+
+  size = (size + 7) & ~7;
+  if(arena->used + size > arena->size)
+    return NULL;
+
+  p = arena->base + arena->used;
+  arena->used += size;
+  if(arena->used > arena->peak)
+    arena->peak = arena->used;
+  return p;
+}
+
+static voidpf zalloc(voidpf opaque, uInt items, uInt size) {
+  void *p = arenaAlloc((arena_t*)opaque, (size_t)items*size);
+  return p ? p : Z_NULL;
+}
+
+static void zfree(voidpf opaque, voidpf address) {
+  // everything is released at once when the arena is reset
+}
+
+// set up the inflate state once per profile, and just reset it after that
+int codecStart(session_t *ss) {
+  int rc;
+
+  if(ss->inflating) {
+    rc = inflateReset(&ss->strm);
+    if(rc != Z_OK) {
+      fprintf(stderr, "inflateReset: %s\n", zError(rc));
+      return -1;
+    }
+    return 0;
+  }
+
+  // whatever the window doesn't need becomes the write buffer
+  ss->arena.used = 0;
+  ss->outSize = ss->arena.size - INFLATE_MEMORY(ss->profile.windowBits);
+  ss->out = arenaAlloc(&ss->arena, ss->outSize);
+
+  memset(&ss->strm, 0, sizeof(ss->strm));
+  ss->strm.zalloc = zalloc;
+  ss->strm.zfree  = zfree;
+  ss->strm.opaque = &ss->arena;
+  rc = inflateInit2(&ss->strm, ss->profile.windowBits);
+  if(rc != Z_OK) {
+    fprintf(stderr, "inflateInit2: %s\n", zError(rc));
+    return -1;
+  }
+
+  ss->inflating = true;
+  return 0;
+}
+
+void codecEnd(session_t *ss) {
+  if(ss->inflating)
+    inflateEnd(&ss->strm);
+  ss->inflating = false;
+}
+
+static int writeFull(int fd, const uint8_t *data, size_t size) {
+  int rc;
+
+  while(size > 0) {
+    rc = write(fd, data, size);
+    if(rc <= 0)
+      return -1;
+    data += rc;
+    size -= rc;
+  }
+
+  return 0;
+}
 
-  memset(&strm, 0, sizeof(strm));
+int update(session_t *ss, message_t *msg) {
+  z_stream *strm = &ss->strm;
+  uint8_t  *p;
+  size_t   len;
+  long     offset = 0;
+  int      fd, rc, full;
 
-  if((fp = fopen((char*)msg->data, "wb")) == NULL) {
-    fprintf(stderr, "fopen: '%s': %s\n", msg->data, strerror(errno));
+  // the client may only be sending what follows an unchanged prefix
+  len = strlen((char*)msg->data) + 1;
+  if(msg->header.size >= len + 4) {
+    p = msg->data + len;
+    offset = ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+  }
+
+  if(offset > 0) {
+    fd = open((char*)msg->data, O_WRONLY);
+    if(fd != -1 && (lseek(fd, 0, SEEK_END) < offset
+    || ftruncate(fd, offset) != 0 || lseek(fd, offset, SEEK_SET) != offset)) {
+      fprintf(stderr, "update: '%s': Can't keep %ld bytes\n", msg->data, offset);
+      close(fd);
+      return -1;
+    }
+  }
+  else
+    fd = open((char*)msg->data, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if(fd == -1) {
+    fprintf(stderr, "open: '%s': %s\n", msg->data, strerror(errno));
     msg->header.rc = -1;
     msg->header.size = 0;
     return -1;
   }
 
-  inflateInit(&strm);
+  if(codecStart(ss) == -1) {
+    close(fd);
+    return -1;
+  }
+  strm->next_out  = ss->out;
+  strm->avail_out = ss->outSize;
 
   while(1) {
-    rc = recvMessage(s, msg);
+    rc = recvBudgeted(ss, msg);
     if(rc <= 0) {
       if(rc == 0)
         fprintf(stderr, "Disconnected during transfer\n");
       else
         fprintf(stderr, "Error receiving data: %s\n", strerror(errno));
-      fclose(fp);
-      inflateEnd(&strm);
+      close(fd);
       return rc;
     }
     if(msg->header.size == 0) {
-      if(strm.total_out > 0)
+      if(strm->total_out > 0)
       {
         printf("Compression ratio: %lu.%02lu\n",
-          strm.total_in/strm.total_out,
-          (strm.total_in * 100 / strm.total_out) % 100);
+          strm->total_in/strm->total_out,
+          (strm->total_in * 100 / strm->total_out) % 100);
       }
       else
         printf("Compression ratio: empty file\n");
-      fclose(fp);
-      inflateEnd(&strm);
+      // whatever is left in the write buffer
+      rc = writeFull(fd, ss->out, strm->next_out - ss->out);
+      if(close(fd) != 0 || rc != 0) {
+        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+        return -1;
+      }
       return 1;
     }
 
-    strm.avail_in = msg->header.size;
-    strm.next_in  = msg->data;
+    strm->avail_in = msg->header.size;
+    strm->next_in  = msg->data;
 
     do {
-      strm.avail_out = sizeof(buf);
-      strm.next_out  = buf;
-      inflate(&strm, Z_NO_FLUSH);
-      rc = fwrite(buf, 1, strm.next_out - buf, fp);
-      if(rc != strm.next_out - buf) {
-        fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
-        fclose(fp);
-        inflateEnd(&strm);
+      rc = inflate(strm, Z_NO_FLUSH);
+      if(rc != Z_OK && rc != Z_STREAM_END && rc != Z_BUF_ERROR) {
+        fprintf(stderr, "inflate: %s\n", strm->msg ? strm->msg : zError(rc));
+        close(fd);
+        codecEnd(ss);
         return -1;
       }
-      if(strm.avail_in > 0)
-        FeOS_Yield();
-    } while(strm.avail_in > 0);
+      if(rc == Z_STREAM_END && strm->avail_out > 0)
+        break;
+
+      // only write whole buffers; inflate may have more once there's room
+      full = strm->avail_out == 0;
+      if(full) {
+        if(writeFull(fd, ss->out, ss->outSize) != 0) {
+          fprintf(stderr, "Error writing to file: %s\n", strerror(errno));
+          close(fd);
+          return -1;
+        }
+        strm->next_out  = ss->out;
+        strm->avail_out = ss->outSize;
+      }
+      budgetCheck(ss);
+    } while(strm->avail_in > 0 || full);
+  }
+}
+
+static inline u32 sliceElapsed(void) {
+  return timerTicks2usec(cpuGetTiming() - budget.start);
+}
+
+void budgetStart(session_t *ss) {
+  memset(&ss->usage, 0, sizeof(ss->usage));
+  budget.start = cpuGetTiming();
+}
+
+void budgetCheck(session_t *ss) {
+  u32 elapsed = sliceElapsed();
+
+  // running sessions split the slice between them
+  if(elapsed < budget.sliceUsec / (activeSessions > 1 ? activeSessions : 1))
+    return;
+
+  ss->usage.busyUsec += elapsed;
+  ss->usage.slices++;
+
+  switch(budget.mode) {
+    case BUDGET_FIXED:
+      swiWaitForVBlank();
+      ss->usage.yields++;
+      break;
+    case BUDGET_AUTO:
+      // returns right away when no foreground app wants the CPU
+      FeOS_Yield();
+      ss->usage.yields++;
+      break;
+    case BUDGET_FULL:
+      break;
+  }
+
+  budget.start = cpuGetTiming();
+}
+
+void budgetWait(void) {
+  // the slice so far was mostly spent blocked on the socket, not working
+  if(budget.mode == BUDGET_FIXED)
+    swiWaitForVBlank();
+  else
+    FeOS_Yield();
+
+  budget.start = cpuGetTiming();
+}
+
+// a stalled transfer gets this many frames after a stop before it is dropped
+#define QUIT_GRACE_FRAMES (5*60)
+
+int budgetBlocked(void) {
+  // sleep through a frame rather than spin on a socket with nothing to do
+  swiWaitForVBlank();
+  budget.start = cpuGetTiming();
+
+  return quit && ++quitWaits > QUIT_GRACE_FRAMES;
+}
+
+/* Wait for the client's next request. Returns 0 if it hung up or the daemon
+ * is stopping; a sync in progress always gets to finish its request first.
+ */
+int waitRequest(session_t *ss) {
+  char c;
+  int  rc;
+
+  ss->usage.busyUsec += sliceElapsed();
+  while(1) {
+    rc = recv(ss->s, &c, 1, MSG_PEEK);
+    if(rc > 0)
+      break;
+    if(rc == 0 || errno != EWOULDBLOCK || quit) {
+      rc = 0;
+      break;
+    }
+    swiWaitForVBlank();
   }
+  budget.start = cpuGetTiming();
+
+  return rc;
+}
+
+int recvBudgeted(session_t *ss, message_t *msg) {
+  int rc;
+
+  // time spent waiting on the client doesn't count as work
+  ss->usage.busyUsec += sliceElapsed();
+  rc = recvMessage(ss->s, msg);
+  budget.start = cpuGetTiming();
+
+  return rc;
+}
+
+void budgetReport(session_t *ss) {
+  ss->usage.busyUsec += sliceElapsed();
+  budget.start = cpuGetTiming();
+
+  printf("Budget: %s, %luus slices\n",
+         budgetModes[budget.mode], (unsigned long)budget.sliceUsec);
+  printf("Used: %lums busy, %lu full slices, %lu yields\n",
+         (unsigned long)(ss->usage.busyUsec / 1000),
+         (unsigned long)ss->usage.slices, (unsigned long)ss->usage.yields);
+  if(ss->usage.yields > 0)
+    printf("Average: %luus per turn\n",
+           (unsigned long)(ss->usage.busyUsec / ss->usage.yields));
 }